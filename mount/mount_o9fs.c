@@ -1,14 +1,18 @@
 #include <sys/param.h>
 #include <sys/mount.h>
 #include <sys/socket.h>
+#include <sys/sysctl.h>
 #include <sys/vnode.h>
+#include <sys/rwlock.h>
 #include <sys/un.h>
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -20,14 +24,98 @@
 
 const struct mntopt opts[] = { MOPT_STDOPTS, { NULL } };
 
+enum {
+	Maxsockbuf	= 64*1024*1024,
+};
+
+/* Socket options for the connections to a server in the network */
+struct {
+	int	nodelay;
+	int	keepalive;
+	int	sndbuf;		/* 0 for the system default */
+	int	rcvbuf;
+} sockopts;
+
+void	o9fsopts(char *, struct o9fs_args *, int *);
+
 __dead void
 usage(void)
 {
 	extern char *__progname;
 	fprintf(stderr, "usage: %s [-v] [-o options] type!address[!port] mountpoint\n", __progname);
+	fprintf(stderr, "       %s -s\n", __progname);
 	exit(1);
 }
 
+/*
+ * If o is name=value, parse value as a number in [min, max] into v.
+ */
+int
+numopt(char *o, char *name, long long min, long long max, long long *v)
+{
+	const char *errstr;
+	size_t n;
+
+	n = strlen(name);
+	if (strncmp(o, name, n) != 0 || o[n] != '=')
+		return 0;
+	*v = strtonum(o + n + 1, min, max, &errstr);
+	if (errstr != NULL)
+		errx(1, "-o %s: value is %s", o, errstr);
+	return 1;
+}
+
+/*
+ * Take the o9fs options out of the -o list,
+ * hand the rest to getmntopts.
+ */
+void
+o9fsopts(char *optarg, struct o9fs_args *args, int *flags)
+{
+	char *o;
+	long long v;
+
+	while ((o = strsep(&optarg, ",")) != NULL) {
+		if (*o == '\0')
+			continue;
+		if (numopt(o, "msize", O9FS_MINMSIZE, O9FS_MAXMSIZE, &v))
+			args->msize = v;
+		else if (numopt(o, "timeout", 0, O9FS_MAXTIMEOUT, &v))
+			args->timeout = v;
+		else if (numopt(o, "nconn", 1, O9FS_MAXCONN, &v))
+			args->nconn = v;
+		else if (numopt(o, "bulkmax", O9FS_MINMSIZE, O9FS_MAXBULK, &v))
+			args->bulkmax = v;
+		else if (numopt(o, "maxfids", O9FS_MINFIDS, O9FS_MAXFIDS, &v))
+			args->maxfids = v;
+		else if (numopt(o, "actimeo", 0, O9FS_MAXACTIMEO, &v))
+			args->actimeo = v;
+		else if (strcmp(o, "noac") == 0)
+			args->actimeo = 0;
+		else if (numopt(o, "dircache", 0, O9FS_MAXDIRCACHE, &v))
+			args->dircache = v;
+		else if (strncmp(o, "ring=", 5) == 0) {
+			if ((args->ringfd = open(o + 5, O_RDWR)) < 0)
+				err(1, "%s", o + 5);
+		} else if (strncmp(o, "aname=", 6) == 0)
+			args->aname = o + 6;
+		else if (strcmp(o, "share") == 0)
+			args->flags |= O9FS_MSHARE;
+		else if (strcmp(o, "reconnect") == 0)
+			args->flags |= O9FS_MRECONN;
+		else if (strcmp(o, "nodelay") == 0)
+			sockopts.nodelay = 1;
+		else if (strcmp(o, "keepalive") == 0)
+			sockopts.keepalive = 1;
+		else if (numopt(o, "sndbuf", 1024, Maxsockbuf, &v))
+			sockopts.sndbuf = v;
+		else if (numopt(o, "rcvbuf", 1024, Maxsockbuf, &v))
+			sockopts.rcvbuf = v;
+		else
+			getmntopts(o, opts, flags);
+	}
+}
+
 int
 connunix(char *path)
 {
@@ -35,53 +123,93 @@ connunix(char *path)
 	struct sockaddr_un channel;
 
 	s = socket(PF_UNIX, SOCK_STREAM, 0);
-	if (s < 0)
-		err(1, "Failed to create UNIX socket");
+	if (s < 0) {
+		warn("Failed to create UNIX socket");
+		return -1;
+	}
 
 	bzero(&channel, sizeof(channel));
 	channel.sun_family = PF_UNIX;
 	channel.sun_len = strlen(path);
 	strlcpy(channel.sun_path, path, sizeof(channel.sun_path));
 
-	if ((connect(s, (struct sockaddr *) &channel, sizeof(channel))) < 0)
-		err(1, "Failed to connect");
+	if ((connect(s, (struct sockaddr *) &channel, sizeof(channel))) < 0) {
+		warn("Failed to connect");
+		close(s);
+		return -1;
+	}
 	return s;
 }
 
-int
-conninet(char *host, int port)
+/*
+ * Set the -o socket options on s. The buffer sizes go in
+ * before connecting, for TCP to pick its window scale from them.
+ */
+void
+setsockopts(int s)
 {
-	int s;
-	struct hostent *hp;
-	struct sockaddr_in con;
+	int on;
 
-	hp = gethostbyname(host);
-	if (hp == NULL)
-		err(1, "Failed to resolve name %s", host);
+	on = 1;
+	if (sockopts.nodelay &&
+	    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+		warn("nodelay");
+	if (sockopts.keepalive &&
+	    setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) < 0)
+		warn("keepalive");
+	if (sockopts.sndbuf &&
+	    setsockopt(s, SOL_SOCKET, SO_SNDBUF, &sockopts.sndbuf, sizeof(sockopts.sndbuf)) < 0)
+		warn("sndbuf");
+	if (sockopts.rcvbuf &&
+	    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &sockopts.rcvbuf, sizeof(sockopts.rcvbuf)) < 0)
+		warn("rcvbuf");
+}
 
-	s = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (s < 0)
-		err(1, "Failed to create INET socket");
+/*
+ * Connect to port, a number or a service name, at host,
+ * trying each of its addresses, IPv4 or IPv6.
+ */
+int
+conninet(char *host, char *port)
+{
+	struct addrinfo hints, *res, *ai;
+	int s, error;
 
-	bzero(&con, sizeof(con));
-	con.sin_family = AF_INET;
-	memmove(&con.sin_addr.s_addr, hp->h_addr, hp->h_length);
-	con.sin_port = htons(port);
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	error = getaddrinfo(host, port, &hints, &res);
+	if (error) {
+		warnx("%s: %s", host, gai_strerror(error));
+		return -1;
+	}
 
-	if((connect(s, (struct sockaddr *) &con, sizeof(struct sockaddr_in))) < 0)
-		err(1, "Failed to connect");
+	s = -1;
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (s < 0)
+			continue;
+		setsockopts(s);
+		if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(s);
+		s = -1;
+	}
+	if (s < 0)
+		warn("Failed to connect to %s", host);
+	freeaddrinfo(res);
 	return s;
 }
 
 /*
  * Parse either unix or network address argument and connect accordingly.
- * Return the connected file descriptor.
+ * Return the connected file descriptor, or -1.
  */
 int
 dial(char *arg)
 {
 	char *p, addr[MAXPATHLEN];
-	int i, port;
+	int i;
 
 	if (arg == NULL)
 		return -1;
@@ -92,29 +220,158 @@ dial(char *arg)
 		addr[i++] = *p++;
 	addr[i] = '\0';
 
-	if (*p == '!') {
-		p++;
-		port = atoi(p);
-		return conninet(addr, port);
-	}
+	if (*p == '!')
+		return conninet(addr, p + 1);
 
 	return connunix(addr);
 }
 	
 	
+/*
+ * Get the statistics of every o9fs mount, return how many.
+ */
+int
+getstats(struct o9fsstats **st)
+{
+	struct vfsconf vfc;
+	size_t len;
+	int mib[3];
+
+	if (getvfsbyname(MOUNT_O9FS, &vfc) < 0)
+		err(1, "getvfsbyname");
+
+	mib[0] = CTL_VFS;
+	mib[1] = vfc.vfc_typenum;
+	mib[2] = O9FS_STATS;
+	if (sysctl(mib, 3, NULL, &len, NULL, 0) < 0)
+		err(1, "sysctl");
+	*st = NULL;
+	if (len == 0)
+		return 0;
+	if ((*st = malloc(len)) == NULL)
+		err(1, NULL);
+	if (sysctl(mib, 3, *st, &len, NULL, 0) < 0)
+		err(1, "sysctl");
+	return len / sizeof(**st);
+}
+
+/*
+ * Print the statistics of every o9fs mount.
+ */
+void
+printstats(void)
+{
+	struct o9fsstats *st;
+	int i, c, n;
+	static char *bclass[Nbclass] = { "small", "medium", "msize" };
+
+	n = getstats(&st);
+	for (i = 0; i < n; i++) {
+		printf("%s on %s\n", st[i].mntfromname, st[i].mntonname);
+		printf("\tmsize %u, %u connections, %u bulk bytes in flight\n",
+		    st[i].msize, st[i].nconn, st[i].bulkmax);
+		if (st[i].nshare > 1)
+			printf("\tsession shared by %u mounts\n", st[i].nshare);
+		for (c = 0; c < st[i].nconn; c++)
+			if (st[i].dead & (1 << c))
+				printf("\tconnection %d lost\n", c);
+		printf("\t%u fids in use, fid table of %u, %llu allocated, %llu looked up\n",
+		    st[i].nfid, st[i].fidtab, st[i].fidalloc, st[i].fidlookup);
+		if (st[i].maxfids > 0)
+			printf("\t%u fids active of %u, %u evicted, %u not walked yet, "
+			    "%llu evictions, %llu walked again\n",
+			    st[i].nfid - st[i].nevicted - st[i].nlazy, st[i].maxfids,
+			    st[i].nevicted, st[i].nlazy,
+			    st[i].fidevict, st[i].fidrewalk);
+		printf("\tattributes cached for %us: %llu hits, %llu misses\n",
+		    st[i].actimeo, st[i].attrhit, st[i].attrmiss);
+		printf("\tname cache: %llu hits, %llu misses, %llu entered ahead\n",
+		    st[i].namehit, st[i].namemiss, st[i].nameahead);
+		printf("\t%u directory listings in %u of %u bytes: %llu absent names, %llu evicted\n",
+		    st[i].ndir, st[i].dirmem, st[i].dircache, st[i].dirhit, st[i].direvict);
+		if (st[i].nredial > 0)
+			printf("\t%u connections restored\n", st[i].nredial);
+		if (st[i].ringslots > 0)
+			printf("\tring of %u slots of %u bytes: %llu bells, %llu sleeps\n",
+			    st[i].ringslots, st[i].ringslotsize, st[i].ringbell, st[i].ringsleep);
+		if (st[i].sndbuf > 0)
+			printf("\tsocket: sndbuf %u, rcvbuf %u, nodelay %s, keepalive %s\n",
+			    st[i].sndbuf, st[i].rcvbuf, st[i].nodelay ? "on" : "off",
+			    st[i].keepalive ? "on" : "off");
+		for (c = 0; c < Nbclass; c++)
+			printf("\t%s buffers (%u bytes): %llu hits, %llu misses\n", bclass[c],
+			    st[i].bufsize[c], st[i].bufhit[c], st[i].bufmiss[c]);
+	}
+	free(st);
+}
+
+/*
+ * Stay around while the mount on node is, dialing the server
+ * again for any connection it loses.
+ */
+__dead void
+redial(char *node, char *addr, int flags, struct o9fs_args *args)
+{
+	struct o9fsstats *st;
+	uint32_t dead;
+	int i, n, found;
+
+	if (daemon(0, 0) < 0)
+		err(1, "daemon");
+	for (;;) {
+		sleep(1);
+		n = getstats(&st);
+		found = 0;
+		dead = 0;
+		for (i = 0; i < n; i++)
+			if (strcmp(st[i].mntonname, node) == 0) {
+				found = 1;
+				dead = st[i].dead;
+				args->nconn = st[i].nconn;
+			}
+		free(st);
+		if (!found)
+			exit(0);
+		if (dead == 0)
+			continue;
+
+		for (i = 0; i < args->nconn; i++)
+			args->fd[i] = (dead & (1 << i)) ? dial(addr) : -1;
+		if (mount(MOUNT_O9FS, node, flags | MNT_UPDATE, args) < 0)
+			warn("mount update");
+		for (i = 0; i < args->nconn; i++)
+			if (args->fd[i] >= 0)
+				close(args->fd[i]);
+	}
+}
+
 int
 main(int argc, char *argv[])
 {
 	struct o9fs_args args;
 	char node[MAXPATHLEN];
-	int ch, flags;
+	int ch, flags, sflag, i, n;
 
+	sflag = 0;
 	args.verbose = 0;
+	args.msize = 0;
+	args.timeout = 0;
+	args.bulkmax = 0;
+	args.maxfids = 0;
+	args.actimeo = O9FS_ACTIMEO;
+	args.dircache = O9FS_DIRCACHE;
+	args.ringfd = -1;
+	args.nconn = 1;
+	args.aname = NULL;
+	args.flags = 0;
 	flags = 0;
-	while ((ch = getopt(argc, argv, "o:v")) != -1)
+	while ((ch = getopt(argc, argv, "o:sv")) != -1)
 		switch (ch) {
 		case 'o':
-			getmntopts(optarg, opts, &flags);
+			o9fsopts(optarg, &args, &flags);
+			break;
+		case 's':
+			sflag = 1;
 			break;
 		case 'v':
 			args.verbose = 1;
@@ -126,19 +383,44 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	if (sflag) {
+		if (argc != 0)
+			usage();
+		printstats();
+		return 0;
+	}
+
 	if (argc != 2)
 		usage();
 
 	args.hostname = argv[0];
-	args.fd = dial(argv[0]);
-	if (args.fd < 0)
-		err(1, "Failed to dial");
-
 	if (realpath(argv[1], node) == NULL)
 		err(1, "realpath %s", argv[1]);
 
+	/* Try joining a session first, there is no need to dial then */
+	if (args.flags & O9FS_MSHARE) {
+		n = args.nconn;
+		args.nconn = 0;
+		if (mount(MOUNT_O9FS, node, flags, &args) == 0) {
+			if (args.flags & O9FS_MRECONN)
+				redial(node, argv[0], flags, &args);
+			return 0;
+		}
+		if (errno != ENOENT)
+			err(1, "mount");
+		args.nconn = n;
+	}
+
+	for (i = 0; i < args.nconn; i++) {
+		args.fd[i] = dial(argv[0]);
+		if (args.fd[i] < 0)
+			err(1, "Failed to dial");
+	}
+
 	if (mount(MOUNT_O9FS, node, flags, &args) < 0)
 		err(1, "mount");
+	if (args.flags & O9FS_MRECONN)
+		redial(node, argv[0], flags, &args);
 	return 0;
 }
 
@@ -36,23 +36,77 @@ struct o9stat {
 };
 
 /*
- * Many vnodes can refer to the same o9fid and this is accounted for in ref.
+ * The opens sharing an open o9fid are accounted for in ref, see o9fs_open.
  * When ref drops to zero, the o9fid is clunked.
- * Every change in o9fid should be checking in the cloning process in o9fs_9p.c:/^o9fs_walk
+ * Every change in o9fid should be checking in the cloning process in o9fs_9p.c:/^o9fs_clonefid
  */
 struct o9fid {
 	int32_t		fid;
+	struct		o9conn *conn;	/* Connection the fid lives on */
+	char		*path;			/* From the root, for walking on another conn, or nil */
 	int8_t		mode;			/* open mode */
+	int8_t		flags;
 	uint32_t	iounit;
 	struct		o9qid	qid;
 	uint64_t	offset;
 
-	struct		o9fid *parent;
 	int			ref;
+	int			pin;			/* Users about to send on it, see o9fs_fiduse */
 	TAILQ_ENTRY(o9fid) next;
+	TAILQ_ENTRY(o9fid) lru;		/* In the mount's lru while O9FID_LRU, or its clunkq */
 };
 
-#define VTO9(vp) ((struct o9fid *)(vp)->v_data)
+/*
+ * The names in a directory read whole, to answer lookups of names
+ * that are not there without asking the server, see o9fs_dirabsent.
+ * Hash and names follow the structure in the same allocation.
+ */
+struct o9dir {
+	struct		o9node *np;
+	uint32_t	vers;			/* Qid.vers of the directory when read */
+	int			time;			/* Ticks when read */
+	size_t		size;			/* Bytes allocated */
+	u_int		mask;			/* Hash size less one, a power of 2 less one */
+	uint32_t	*hash;			/* Offsets in names plus one, 0 if free */
+	char		*names;			/* NUL terminated */
+	TAILQ_ENTRY(o9dir) lru;		/* In the mount's dirlru */
+};
+
+/*
+ * What a vnode points to. Its lock is the vnode lock, which
+ * also covers the offset and mode of the fids.
+ * Fid is never open, the opens of the vnode share a clone of it
+ * per access mode, which is only opened on the first read or write.
+ */
+struct o9node {
+	struct		o9fid *fid;
+	struct		o9fid *open[3];	/* By 9P access mode, OREAD, OWRITE or ORDWR, or nil */
+	struct		o9fid *created;	/* Opened by Tcreate, for the open that follows */
+	struct		lock lock;
+	struct		vnode *vp;
+	int			flags;
+	LIST_ENTRY(o9node) hash;	/* In the mount's nodehash by qid.path */
+
+	struct		o9stat attr;	/* Cached stat, see o9fs_getattr */
+	int			attrtime;		/* Ticks when it was taken */
+	struct		o9dir *dir;		/* Listing of a directory, or nil */
+};
+
+enum {
+	O9NODE_HASHED	= 0x01,		/* In nodehash, see o9fs_nodeget */
+	O9NODE_ATTR		= 0x02,		/* Attr is valid */
+};		/* o9node flags */
+
+enum {
+	O9FID_WALKED	= 0x01,		/* The server knows it, see o9fs_reconnect */
+	O9FID_LRU		= 0x02,		/* Unopened, may be evicted */
+	O9FID_EVICTED	= 0x04,		/* Clunked to save fids, walked again when used */
+	O9FID_BUSY		= 0x08,		/* Being evicted or walked again */
+	O9FID_LAZY		= 0x10,		/* Not walked yet, o9fs_fiduse does it */
+};		/* o9fid flags */
+
+#define VTON(vp) ((struct o9node *)(vp)->v_data)
+#define VTO9(vp) (VTON(vp)->fid)
 #define VFSTOO9FS(mp) ((struct o9fs *)((mp)->mnt_data))
 
 enum {
@@ -61,28 +115,236 @@ enum {
 
 	Minhd	= Offtag + 2,		/* Minimum 9P header size, independent of message type */
 	Maxhd	= 24,				/* Maximum 9P header size */
+
+	Ntag	= 256,				/* Maximum number of outstanding requests */
+	Nbatch	= 8,				/* Maximum number of requests sent in one write */
+
+	Smeta	= 0,				/* Scheduling classes, metadata goes first */
+	Sbulk,
+	Nsched,
+};
+
+/*
+ * Message buffers come in three classes: Small, which fits every
+ * message without data, Medium and msize. Medium is skipped when
+ * msize is not larger than it.
+ */
+enum {
+	Bsmall,
+	Bmedium,
+	Bmsize,
+	Nbclass,
+
+	Smallbuf	= 256,
+	Mediumbuf	= 8192+Maxhd,
+};
+
+#define O9FS_MSIZE		(8192+Maxhd)		/* Default msize */
+#define O9FS_MINMSIZE	(512+Maxhd)
+#define O9FS_MAXMSIZE	(1024*1024+Maxhd)
+#define O9FS_MAXCONN	8					/* Most connections per mount */
+#define O9FS_MAXWELEM	16					/* Most names in a Twalk */
+#define O9FS_BULKMAX	4					/* Default bulk in flight, in msizes */
+#define O9FS_MAXBULK	(64*1024*1024)
+#define O9FS_MAXTIMEOUT	3600				/* Longest RPC timeout, in seconds */
+#define O9FS_ACTIMEO	3					/* Default attribute cache time, in seconds */
+#define O9FS_MAXACTIMEO	3600
+#define O9FS_DIRCACHE	(1024*1024)			/* Default bytes of listings per mount */
+#define O9FS_MAXDIRCACHE	(64*1024*1024)
+#define O9FS_NODEHASH	256					/* Buckets of the vnode hash */
+#define O9FS_MINFIDS	16					/* Smallest fid budget of a mount */
+#define O9FS_MAXFIDS	(1024*1024)
+#define O9FS_MAXRING	(64*1024*1024)		/* Largest ring region wired, see o9fs_ringattach */
+
+/*
+ * A 9P transaction.
+ * The T-message is packed into tx, with its size in the first four bytes
+ * as usual, and o9fs_rpc fills rx with the R-message carrying the same tag.
+ */
+struct o9req {
+	uint16_t	tag;
+	int			flags;
+	int			error;
+	u_char		*tx;
+	u_char		*rx;
+	u_long		txsize;			/* Size of the buffers, */
+	u_long		rxsize;			/* not of the messages */
+	struct		uio *uio;		/* Twrite or Rread data, if not in tx or rx */
+	struct		o9conn *conn;	/* Connection to send it on */
+	long		bulk;			/* Bytes of file data it moves, see o9fs_schedin */
+	TAILQ_ENTRY(o9req) next;
+	TAILQ_ENTRY(o9req) sndnext;	/* In the connection's sndq while waiting to send */
+};
+
+enum {
+	O9REQ_DONE	= 0x01,			/* rx holds the reply, or error is set */
+	O9REQ_INUIO	= 0x02,			/* Rread data went straight to uio */
+	O9REQ_FLUSH	= 0x04,			/* Abandoned, a Tflush for it is in flight */
+	O9REQ_LOST	= 0x08,			/* No reply, the connection went away */
+};
+
+/*
+ * Per mount statistics, read through the vfs.o9fs.stats sysctl.
+ */
+struct o9fsstats {
+	char		mntonname[MNAMELEN];
+	char		mntfromname[MNAMELEN];
+	uint32_t	msize;
+	uint32_t	nconn;
+	uint32_t	nshare;				/* Mounts sharing the session */
+	uint32_t	bulkmax;
+	uint32_t	dead;				/* Lost connections, bit per connection */
+	uint32_t	nredial;			/* Connections brought back */
+	uint32_t	nfid;				/* Fids in use by the mount */
+	uint32_t	nevicted;			/* Of them, clunked by o9fs_fidevict */
+	uint32_t	nlazy;				/* Of them, not walked yet, see o9fs_fidlazy */
+	uint32_t	maxfids;			/* Budget of fids the server knows, 0 for none */
+	uint32_t	fidtab;				/* Size of the session's fid table */
+	uint64_t	fidalloc;
+	uint64_t	fidlookup;
+	uint64_t	fidevict;			/* Evictions */
+	uint64_t	fidrewalk;			/* Evicted fids walked again */
+	uint32_t	actimeo;			/* Attribute cache time in seconds */
+	uint64_t	attrhit;			/* Getattrs from the cache */
+	uint64_t	attrmiss;			/* Getattrs that sent a Tstat */
+	uint64_t	namehit;			/* Lookups from the name cache */
+	uint64_t	namemiss;			/* Lookups that sent a Twalk */
+	uint64_t	nameahead;			/* Names cached by the Twalk of a name before */
+	uint32_t	dircache;			/* Bytes of listings allowed */
+	uint32_t	dirmem;				/* Bytes of listings kept */
+	uint32_t	ndir;				/* Directories with a listing */
+	uint64_t	dirhit;				/* Lookups of absent names answered by one */
+	uint64_t	direvict;			/* Listings dropped to make room */
+	uint32_t	ringslots;			/* Ring of the first connection, 0 for none */
+	uint32_t	ringslotsize;
+	uint64_t	ringbell;			/* Times the server was woken */
+	uint64_t	ringsleep;			/* Times the reader slept on an empty ring */
+	uint32_t	sndbuf;				/* Socket of the first connection, as applied */
+	uint32_t	rcvbuf;
+	uint8_t		nodelay;
+	uint8_t		keepalive;
+	uint32_t	bufsize[Nbclass];
+	uint64_t	bufhit[Nbclass];	/* Buffers taken from the free lists */
+	uint64_t	bufmiss[Nbclass];	/* Buffers malloced */
+};
+
+/* vfs.o9fs sysctl names */
+#define O9FS_STATS	1			/* struct o9fsstats of every mount */
+
+/*
+ * The kernel's side of a ring shared with a local server, see
+ * ring/o9ring.h and o9fs_ringattach. The server can scribble over
+ * the region at any time, so its geometry is kept here instead.
+ */
+struct o9kring {
+	struct	o9ringhdr *hdr;		/* Start of the region in the kernel map */
+	u_char	*slots[2];			/* By ring */
+	uint32_t	nslot;
+	uint32_t	slotsize;
+	uint32_t	head;			/* T-messages posted */
+	uint32_t	tail;			/* R-messages taken */
+	u_long	size;				/* Bytes mapped */
+	struct	file *fp;			/* File of the region */
+	uint64_t	nbell;
+	uint64_t	nsleep;
+};
+
+/*
+ * A connection to the server, with its own version and attach.
+ * A mount stripes its open fids over one or more of them.
+ */
+struct o9conn {
+	struct	file *fp;			/* File pointing to the server */
+	struct	o9kring *ring;		/* Messages go here instead if set, fp is just the bell */
+	int		flags;
+	int		nopen;				/* Open fids, see o9fs_walkopen */
+
+	/*
+	 * Requests in flight, see o9fs_rpc.c.
+	 * Every request waiting for its reply is in reqq and,
+	 * except for Tversion, in tags indexed by its tag.
+	 * The send lock and the reader role are held across sleeps on
+	 * the socket; the rest only changes between sleeps, under the
+	 * kernel lock like the socket itself.
+	 */
+	struct	o9req *tags[Ntag];
+	int		nexttag;
+	TAILQ_HEAD(, o9req) reqq;
+
+	/* Requests waiting to send, by class; see o9fs_schedin */
+	TAILQ_HEAD(, o9req) sndq[Nsched];
+	long	bulk;				/* Bulk bytes in flight */
+
+	int		gen;				/* Bumped when brought back, see o9fs_reconnect */
+	struct	proc *redial;		/* Process bringing it back */
+};
+
+/*
+ * The negotiated connections to a server.
+ * Mounts of the same server with -o share attach over the same session.
+ */
+struct o9sess {
+	char	name[MNAMELEN];		/* Server, as given to mount */
+	int		ref;				/* Mounts using it */
+	int		share;				/* In the list of shared sessions */
+	int		reconnect;			/* Wait for lost connections to be dialed again */
+	int		nredial;
+	struct	o9conn *conn;		/* Connections to the server */
+	int		nconn;
+	long	msize;				/* Maximum 9P message size */
+	int		timeout;			/* RPC timeout in ticks, 0 for none */
+	long	bulkmax;			/* Bulk bytes in flight per connection */
+	/* Fids are unique over the connections, fidmap has a bit set for each in use */
+	struct	o9fid **fids;		/* By number */
+	uint32_t	*fidmap;
+	int		nfids;				/* Size of both */
+
+	struct	rwlock lock;		/* Covers the fid table, freereq and bufs */
+	TAILQ_HEAD(, o9req) freereq;
+
+	/* Free message buffers by class, linked through their first word */
+	struct {
+		void	*free;
+		int		nfree;
+	} bufs[Nbclass];
+
+	LIST_HEAD(, o9fs) mounts;
+	LIST_ENTRY(o9sess) next;
 };
 
 struct o9fs {
 	struct	mount *mp;
 	struct	vnode *vroot;		/* Local root of the tree */
-	struct	file *servfp;		/* File pointing to the server */
-	long	msize;				/* Maximum 9P message size */
-	
-	/* 
-     * Buffers for I/O
-	 * Both buffers have the client requested msize,
-	 * but only the number of bytes in this structure's msize
-	 * should be used.
-	 */
-	u_char	*inbuf;
-	u_char	*outbuf;
+	struct	o9sess *sess;
+	struct	o9fid *root[O9FS_MAXCONN];	/* Fid of the attach, by connection */
+	char	aname[MNAMELEN];
+	LIST_ENTRY(o9fs) next;		/* In the session's mounts */
 
+	struct	o9fsstats stats;
+
+	struct	rwlock fidlock;		/* Covers activeq, lru and clunkq */
 	TAILQ_HEAD(, o9fid)	activeq;
-	TAILQ_HEAD(, o9fid) freeq;
-	int	nextfid;
+	TAILQ_HEAD(, o9fid)	lru;	/* Unopened fids, least recently used first */
+	TAILQ_HEAD(, o9fid)	clunkq;	/* Fids to clunk, see o9fs_clunkdefer */
+	int		clunking;			/* A worker is sending clunkq */
+	struct	workq *clunkwq;		/* Its own, a slow server stalls no one else */
+	int		maxfids;			/* Fids the server may know, 0 for no limit */
+	int		actimeo;			/* Attribute cache time in ticks, 0 for none */
+	size_t	dircache;			/* Bytes of listings allowed, 0 for none */
+	TAILQ_HEAD(, o9dir) dirlru;	/* Listings, least recently used first */
+
+	/* Vnodes by the qid.path of their file, under the kernel lock */
+	LIST_HEAD(o9nodehash, o9node) *nodehash;
+	u_long	nodehashmask;
 };
 
+enum {
+	O9FS_SNDLOCK	= 0x01,		/* Somebody is writing to the server */
+	O9FS_RCVLOCK	= 0x04,		/* Somebody is reading from the server */
+	O9FS_WANTTAG	= 0x08,		/* Waiting for a free tag */
+	O9FS_DEAD		= 0x10,		/* Connection to the server is gone */
+};		/* o9conn flags */
+
 
 /* O9FS_STATFIXLEN includes leading 16-bit count */
 /* The count, however, excludes itself; total size is O9FS_BIT16SZ+count */
@@ -163,6 +425,20 @@ enum
 #define VT_O9FS VT_NON
 struct o9fs_args {
 	char	*hostname;
-	int		fd;
+	int		fd[O9FS_MAXCONN];	/* Connections to the server, */
+	int		nconn;				/* all to the same tree, 0 to join a shared session */
 	uint8_t	verbose;
+	uint32_t	msize;			/* Proposed msize, 0 for O9FS_MSIZE */
+	uint32_t	timeout;		/* RPC timeout in seconds, 0 for none */
+	uint32_t	bulkmax;		/* Bulk bytes in flight, 0 for O9FS_BULKMAX msizes */
+	uint32_t	maxfids;		/* Fid budget of the mount, 0 for none */
+	uint32_t	actimeo;		/* Attribute cache time in seconds, 0 for none */
+	uint32_t	dircache;		/* Bytes of directory listings kept, 0 for none */
+	int		ringfd;				/* Ring shared with a local server, -1 for none */
+	char	*aname;				/* Tree to attach, nil for the default */
+	int		flags;
 };
+
+/* o9fs_args flags */
+#define O9FS_MSHARE	0x01		/* Share the session with other mounts of the server */
+#define O9FS_MRECONN	0x02		/* Dial lost connections again */
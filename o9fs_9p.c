@@ -5,6 +5,8 @@
 #include <sys/namei.h>
 #include <sys/queue.h>
 #include <sys/stat.h>
+#include <sys/rwlock.h>
+#include <sys/workq.h>
 
 #include "o9fs.h"
 #include "o9fs_extern.h"
@@ -13,133 +15,457 @@ enum{
 	Debug = 0,
 };
 
-void
-o9fs_clunkremove(struct o9fs *fs, struct o9fid *f, uint8_t type)
+/*
+ * Requests are built by the o9fs_t* functions and their replies
+ * applied by the o9fs_r* ones, so that dependent requests can be
+ * batched with o9fs_rpcv. See o9fs_walkopen and o9fs_walkcreate.
+ */
+
+struct o9req *
+o9fs_tclunkremove(struct o9fs *fs, struct o9fid *f, uint8_t type)
 {
-	DIN();
+	struct o9req *r;
 
 	if (f == NULL)
 		panic("o9fs_clunk: nil fid");
 
-	O9FS_PBIT32(fs->outbuf, 11);
-	O9FS_PBIT8(fs->outbuf + Offtype, type);
-	O9FS_PBIT16(fs->outbuf + Offtag, o9fs_tag());
-	O9FS_PBIT32(fs->outbuf + Minhd, f->fid);
-	
-	o9fs_mio(fs, 11);
+	r = o9fs_rpcalloc(fs, Minhd + 4, Minhd);
+	r->conn = f->conn;
+	O9FS_PBIT32(r->tx, 11);
+	O9FS_PBIT8(r->tx + Offtype, type);
+	O9FS_PBIT32(r->tx + Minhd, f->fid);
+	return r;
+}
+
+void
+o9fs_clunkremove(struct o9fs *fs, struct o9fid *f, uint8_t type)
+{
+	struct o9req *r;
+	DIN();
+
+	/* The server already forgot an evicted fid, or never knew a lazy one */
+	while (f->flags & O9FID_BUSY)
+		tsleep(f, PRIBIO, "o9fsfid", 0);
+	if ((f->flags & (O9FID_EVICTED | O9FID_LAZY)) && type == O9FS_TCLUNK) {
+		DRET();
+		return;
+	}
+	if (o9fs_fiduse(fs, f) < 0) {
+		DRET();
+		return;
+	}
+	o9fs_lrudel(fs, f);
+	r = o9fs_tclunkremove(fs, f, type);
+	if (f->mode != -1)
+		f->conn->nopen--;
+	o9fs_rpc(fs, r);
+	o9fs_rpcfree(fs, r);
+	o9fs_fidrele(fs, f);
+
+	/* Even a failed Tremove clunks the fid */
+	f->flags &= ~O9FID_WALKED;
 	DRET();
 }
 
 /*
- * A nul newfid causes fid to be cloned both in the server and in the client.
+ * Send the Tclunks in the clunkq of fs, up to Nbatch of a connection
+ * in one write. Runs from the mount's clunkwq, see o9fs_clunkdefer.
  */
-struct o9fid *
-o9fs_walk(struct o9fs *fs, struct o9fid *fid, struct o9fid *newfid, char *name)
+static void
+o9fs_clunkwork(void *a1, void *a2)
 {
-	long n;
-	u_char *p;
-	int nwname, nwqid;
-	struct o9qid *nqid;
-	DIN();
+	struct o9fs *fs;
+	struct o9conn *c;
+	struct o9fid *f, *nf, *fids[Nbatch];
+	struct o9req *r[Nbatch];
+	int i, n;
+
+	fs = a1;
+	for (;;) {
+		rw_enter_write(&fs->fidlock);
+		if ((f = TAILQ_FIRST(&fs->clunkq)) == NULL) {
+			fs->clunking = 0;
+			rw_exit_write(&fs->fidlock);
+			wakeup(&fs->clunkq);
+			return;
+		}
+		c = f->conn;
+		for (n = 0; f != NULL && n < Nbatch; f = nf) {
+			nf = TAILQ_NEXT(f, lru);
+			if (f->conn == c) {
+				TAILQ_REMOVE(&fs->clunkq, f, lru);
+				fids[n++] = f;
+			}
+		}
+		rw_exit_write(&fs->fidlock);
 
-	if (fid == NULL) {
-		DRET();
+		for (i = 0; i < n; i++) {
+			r[i] = o9fs_tclunkremove(fs, fids[i], O9FS_TCLUNK);
+			if (fids[i]->mode != -1)
+				c->nopen--;
+		}
+		o9fs_rpcv(fs, r, n);
+		for (i = 0; i < n; i++) {
+			o9fs_rpcfree(fs, r[i]);
+			o9fs_putfid(fs, fids[i]);
+		}
+	}
+}
+
+/*
+ * Clunk f and put it back in the pool, without waiting for the server.
+ * Fids the server does not know, e.g. removed or lazy ones, are just
+ * put back, the others wait in clunkq for o9fs_clunkwork.
+ */
+void
+o9fs_clunkdefer(struct o9fs *fs, struct o9fid *f)
+{
+	for (;;) {
+		while (f->flags & O9FID_BUSY)
+			tsleep(f, PRIBIO, "o9fsfid", 0);
+		rw_enter_write(&fs->fidlock);
+		if (!(f->flags & O9FID_BUSY))
+			break;
+		rw_exit_write(&fs->fidlock);
+	}
+	if (f->flags & O9FID_LRU) {
+		TAILQ_REMOVE(&fs->lru, f, lru);
+		f->flags &= ~O9FID_LRU;
+	}
+	if (!(f->flags & O9FID_WALKED)) {
+		rw_exit_write(&fs->fidlock);
+		o9fs_putfid(fs, f);
+		return;
+	}
+	TAILQ_INSERT_TAIL(&fs->clunkq, f, lru);
+	if (fs->clunking) {
+		rw_exit_write(&fs->fidlock);
+		return;
+	}
+	fs->clunking = 1;
+	rw_exit_write(&fs->fidlock);
+	if (fs->clunkwq == NULL ||
+	    workq_add_task(fs->clunkwq, WQ_WAITOK, o9fs_clunkwork, fs, NULL) != 0)
+		o9fs_clunkwork(fs, NULL);
+}
+
+/*
+ * Path of name in the directory dir, or a copy of dir if name is nil.
+ * Nil if dir is unknown or the result would be too long.
+ */
+char *
+o9fs_joinpath(char *dir, char *name)
+{
+	char *p;
+	size_t n;
+
+	if (dir == NULL)
+		return NULL;
+	n = strlen(dir) + 1 + (name ? strlen(name) : 0) + 1;
+	if (n > MAXPATHLEN)
 		return NULL;
+	p = malloc(n, M_O9FS, M_WAITOK);
+	strlcpy(p, dir, n);
+	if (name != NULL) {
+		if (*dir != '\0')
+			strlcat(p, "/", n);
+		strlcat(p, name, n);
 	}
+	return p;
+}
+
+/*
+ * Next name in a slash separated path, its length is put in len.
+ */
+static char *
+walkelem(char *s, long *len)
+{
+	char *e;
+
+	while (*s == '/')
+		s++;
+	for (e = s; *e != '\0' && *e != '/'; e++)
+		;
+	*len = e - s;
+	return s;
+}
 
-	p = fs->outbuf;
+/*
+ * Whether path can be walked to in a single Twalk.
+ */
+static int
+walkable(struct o9fs *fs, char *path)
+{
+	char *s;
+	long len, n;
+	int nwname;
+
+	if (path == NULL)
+		return 0;
+	n = Minhd + 4 + 4 + 2;
+	nwname = 0;
+	for (s = walkelem(path, &len); len > 0; s = walkelem(s + len, &len)) {
+		n += 2 + len;
+		nwname++;
+	}
+	return nwname <= O9FS_MAXWELEM && n <= fs->sess->msize;
+}
+
+/*
+ * End of the most names of path that fit in a single Twalk,
+ * their number is put in nwname.
+ */
+static char *
+walkfit(struct o9fs *fs, char *path, int *nwname)
+{
+	char *e, *end;
+	long len, n;
+
+	n = Minhd + 4 + 4 + 2;
+	*nwname = 0;
+	end = path;
+	for (e = walkelem(path, &len); len > 0; e = walkelem(e + len, &len)) {
+		if (*nwname == O9FS_MAXWELEM || n + 2 + len > fs->sess->msize)
+			break;
+		n += 2 + len;
+		(*nwname)++;
+		end = e + len;
+	}
+	return end;
+}
+
+struct o9fid *
+o9fs_clonefid(struct o9fs *fs, struct o9fid *fid)
+{
+	struct o9fid *newfid;
+
+	DBG("cloning fid %d\n", fid->fid);
+	newfid = o9fs_getfid(fs);
+	newfid->conn = fid->conn;
+	newfid->path = o9fs_joinpath(fid->path, NULL);
+	newfid->mode = fid->mode;
+	newfid->qid = fid->qid;
+	newfid->offset = fid->offset;
+	newfid->ref = fid->ref;
+	return newfid;
+}
+
+/*
+ * Walk fid to name in newfid, a nil name clones fid.
+ * Name may be a path of up to O9FS_MAXWELEM names, see walkable.
+ */
+struct o9req *
+o9fs_twalk(struct o9fs *fs, struct o9fid *fid, struct o9fid *newfid, char *name)
+{
+	long n, len;
+	u_char *p;
+	char *s;
+	int nwname;
+	struct o9req *r;
+
+	n = Minhd + 4 + 4 + 2;
+	nwname = 0;
+	if (name != NULL)
+		for (s = walkelem(name, &len); len > 0; s = walkelem(s + len, &len)) {
+			n += 2 + len;
+			nwname++;
+		}
+	if (nwname > O9FS_MAXWELEM)
+		panic("o9fs_twalk: %d names", nwname);
+	r = o9fs_rpcalloc(fs, n, Minhd + 2 + nwname * O9FS_QIDSZ);
+	r->conn = fid->conn;
+	newfid->conn = fid->conn;
+	p = r->tx;
 	O9FS_PBIT8(p + Offtype, O9FS_TWALK);
-	O9FS_PBIT16(p + Offtag, o9fs_tag());
 	O9FS_PBIT32(p + Minhd, fid->fid);
 
-	if (newfid == NULL) {
-		DBG("cloning fid %d\n", fid->fid);
-		newfid = o9fs_getfid(fs);
-		newfid->mode = fid->mode;
-		newfid->qid = fid->qid;
-		newfid->offset = fid->offset;
-		newfid->parent = fid->parent;
-		newfid->ref = fid->ref;
-		nwname = 0;
-		p += Minhd + 4 + 4 + 2;		/* Advance after nwname, which will be filled later */
+	p += Minhd + 4 + 4 + 2;		/* Advance after nwname, which will be filled later */
+	if (name != NULL)
+		for (s = walkelem(name, &len); len > 0; s = walkelem(s + len, &len)) {
+			O9FS_PBIT16(p, len);
+			memcpy(p + 2, s, len);
+			p += 2 + len;
+		}
+
+	DBG("fid %p %d newfid %p %d\n", fid, fid->fid, newfid, newfid->fid);
+
+	O9FS_PBIT32(r->tx + Minhd + 4, newfid->fid);
+	O9FS_PBIT16(r->tx + Minhd + 4 + 4, nwname);
+
+	n = p - r->tx;
+	O9FS_PBIT32(r->tx, n);
+	return r;
+}
+
+int
+o9fs_rwalk(struct o9fs *fs, struct o9req *r, struct o9fid *newfid)
+{
+	u_char *p;
+	int nwname, nwqid;
+
+	if (r->error)
+		return -1;
+
+	nwname = O9FS_GBIT16(r->tx + Minhd + 4 + 4);
+	nwqid = O9FS_GBIT16(r->rx + Minhd);
+	if (nwqid < nwname) {
+		printf("nwqid < nwname\n");
+		return -1;
 	}
 
-	if (name != NULL) {
-		p = o9fs_putstr(fs->outbuf + Minhd + 4 + 4 + 2, name);
-		nwname = 1;
+	if (nwname > 0) {
+		/* The last qid is the one of newfid */
+		p = r->rx + Minhd + 2 + (nwname - 1) * O9FS_QIDSZ;
+		newfid->qid.type = O9FS_GBIT8(p);
+		newfid->qid.vers = O9FS_GBIT32(p + 1);
+		newfid->qid.path = O9FS_GBIT64(p + 1 + 4);
 	}
+	newfid->flags |= O9FID_WALKED;
+	if (newfid->mode == -1)
+		o9fs_lruadd(fs, newfid);
+	return 0;
+}
 
-	DBG("fid %p %d newfid %p %d\n", fid, fid->fid, newfid, newfid->fid);
+/*
+ * A nul newfid causes fid to be cloned both in the server and in the client.
+ */
+struct o9fid *
+o9fs_walk(struct o9fs *fs, struct o9fid *fid, struct o9fid *newfid, char *name)
+{
+	struct o9req *r;
+	DIN();
 
-	O9FS_PBIT32(fs->outbuf + Minhd + 4, newfid->fid);
-	O9FS_PBIT16(fs->outbuf + Minhd + 4 + 4, nwname);
+	if (fid == NULL) {
+		DRET();
+		return NULL;
+	}
 
-	n = p - fs->outbuf;
-	O9FS_PBIT32(fs->outbuf, n);
-	n = o9fs_mio(fs, n);
-	if (n <= 0) {
+	if (newfid == NULL)
+		newfid = o9fs_clonefid(fs, fid);
+	if (o9fs_fiduse(fs, fid) < 0) {
 		o9fs_putfid(fs, newfid);
 		DRET();
 		return NULL;
 	}
 
-	nwqid = O9FS_GBIT16(fs->inbuf + Minhd);
-	if (nwqid < nwname) {
-		printf("nwqid < nwname\n");
+	r = o9fs_twalk(fs, fid, newfid, name);
+	o9fs_rpc(fs, r);
+	o9fs_fidrele(fs, fid);
+	if (o9fs_rwalk(fs, r, newfid) < 0) {
+		o9fs_rpcfree(fs, r);
+		o9fs_putfid(fs, newfid);
 		DRET();
 		return NULL;
 	}
 
-	if (nwname > 0) {
-		newfid->qid.type = O9FS_GBIT8(fs->inbuf + Minhd + 2);
-		newfid->qid.vers = O9FS_GBIT32(fs->inbuf + Minhd + 2 + 1);
-		newfid->qid.path = O9FS_GBIT64(fs->inbuf + Minhd + 2 + 1 + 4);
+	if (name != NULL) {
+		if (newfid->path != NULL)
+			free(newfid->path, M_O9FS);
+		newfid->path = o9fs_joinpath(fid->path, name);
 	}
-
+	o9fs_rpcfree(fs, r);
 	DRET();
 	return newfid;
 }
 
-struct o9stat *
-o9fs_stat(struct o9fs *fs, struct o9fid *fid)
+/*
+ * Walk fid to as many names of path as fit in a single Twalk, see walkfit,
+ * their number is put in nwname. Returns how many of them the server
+ * walked, with their qids in qid, or -1 on error. Newfid is only kept if
+ * it was walked to all of them, to a path of its own, else it is put.
+ */
+int
+o9fs_walkpath(struct o9fs *fs, struct o9fid *fid, struct o9fid *newfid, char *path, struct o9qid *qid, int *nwname)
+{
+	struct o9req *r;
+	u_char *p;
+	char *end, save;
+	int i, nwqid;
+	DIN();
+
+	end = walkfit(fs, path, nwname);
+	if (*nwname == 0 || o9fs_fiduse(fs, fid) < 0) {
+		o9fs_putfid(fs, newfid);
+		DRET();
+		return -1;
+	}
+
+	save = *end;
+	*end = '\0';
+	r = o9fs_twalk(fs, fid, newfid, path);
+	o9fs_rpc(fs, r);
+	o9fs_fidrele(fs, fid);
+
+	/* An Rerror is a failure on the first name */
+	nwqid = 0;
+	if (r->error == 0)
+		nwqid = O9FS_GBIT16(r->rx + Minhd);
+	if (nwqid > *nwname)
+		nwqid = *nwname;
+	for (i = 0; i < nwqid; i++) {
+		p = r->rx + Minhd + 2 + i * O9FS_QIDSZ;
+		qid[i].type = O9FS_GBIT8(p);
+		qid[i].vers = O9FS_GBIT32(p + 1);
+		qid[i].path = O9FS_GBIT64(p + 1 + 4);
+	}
+	if (nwqid == *nwname && o9fs_rwalk(fs, r, newfid) == 0) {
+		if (newfid->path != NULL)
+			free(newfid->path, M_O9FS);
+		newfid->path = o9fs_joinpath(fid->path, path);
+	} else
+		o9fs_putfid(fs, newfid);
+	o9fs_rpcfree(fs, r);
+	*end = save;
+	DRET();
+	return nwqid;
+}
+
+/*
+ * Stat fid into stat, -1 on error.
+ */
+int
+o9fs_stat(struct o9fs *fs, struct o9fid *fid, struct o9stat *stat)
 {
 	long n, nstat;
-	struct o9stat *stat;
+	struct o9req *r;
 	u_char *p;
 	uint16_t sn;
 	DIN();
 
-	if (fid == NULL) {
+	if (fid == NULL || o9fs_fiduse(fs, fid) < 0) {
 		DRET();
-		return NULL;
+		return -1;
 	}
 
-	O9FS_PBIT32(fs->outbuf, Minhd + 4);
-	O9FS_PBIT8(fs->outbuf + Offtype, O9FS_TSTAT);
-	O9FS_PBIT16(fs->outbuf + Offtag, o9fs_tag());
-	O9FS_PBIT32(fs->outbuf + Minhd, fid->fid);
-	n = o9fs_mio(fs, Minhd + 4);
+	/* Most stats fit in a small buffer, o9fs_rpc gets a larger one otherwise */
+	r = o9fs_rpcalloc(fs, Minhd + 4, Smallbuf);
+	r->conn = fid->conn;
+	O9FS_PBIT32(r->tx, Minhd + 4);
+	O9FS_PBIT8(r->tx + Offtype, O9FS_TSTAT);
+	O9FS_PBIT32(r->tx + Minhd, fid->fid);
+	n = o9fs_rpc(fs, r);
+	o9fs_fidrele(fs, fid);
 	if (n <= 0) {
+		o9fs_rpcfree(fs, r);
 		DRET();
-		return NULL;
+		return -1;
 	}
 
-	n = O9FS_GBIT16(fs->inbuf + Minhd + 2);
-	stat = malloc(n, M_O9FS, M_WAITOK);
-
-	stat->type = O9FS_GBIT16(fs->inbuf + Minhd + 2 + 2);
-	stat->dev = O9FS_GBIT32(fs->inbuf + Minhd + 2 + 2 + 2);
-	stat->qid.type = O9FS_GBIT8(fs->inbuf + Minhd + 2 + 2 + 2 + 4);
-	stat->qid.vers = O9FS_GBIT32(fs->inbuf + Minhd + 2 + 2 + 2 + 4 + 1);
-	stat->qid.path = O9FS_GBIT64(fs->inbuf + Minhd + 2 + 2 + 2 + 4 + 1 + 4);
-	stat->mode = O9FS_GBIT32(fs->inbuf + Minhd + 2 + 2 + 2 + 4 + 1 + 4 + 8);
-	stat->atime = O9FS_GBIT32(fs->inbuf + Minhd + 2 + 2 + 2 + 4 + 1 + 4 + 8 + 4);
-	stat->mtime = O9FS_GBIT32(fs->inbuf + Minhd + 2 + 2 + 2 + 4 + 1 + 4 + 8 + 4 + 4);
-	stat->length = O9FS_GBIT64(fs->inbuf + Minhd + 2 + 2 + 2 + 4 + 1 + 4 + 8 + 4 + 4 + 4);
+	stat->type = O9FS_GBIT16(r->rx + Minhd + 2 + 2);
+	stat->dev = O9FS_GBIT32(r->rx + Minhd + 2 + 2 + 2);
+	stat->qid.type = O9FS_GBIT8(r->rx + Minhd + 2 + 2 + 2 + 4);
+	stat->qid.vers = O9FS_GBIT32(r->rx + Minhd + 2 + 2 + 2 + 4 + 1);
+	stat->qid.path = O9FS_GBIT64(r->rx + Minhd + 2 + 2 + 2 + 4 + 1 + 4);
+	stat->mode = O9FS_GBIT32(r->rx + Minhd + 2 + 2 + 2 + 4 + 1 + 4 + 8);
+	stat->atime = O9FS_GBIT32(r->rx + Minhd + 2 + 2 + 2 + 4 + 1 + 4 + 8 + 4);
+	stat->mtime = O9FS_GBIT32(r->rx + Minhd + 2 + 2 + 2 + 4 + 1 + 4 + 8 + 4 + 4);
+	stat->length = O9FS_GBIT64(r->rx + Minhd + 2 + 2 + 2 + 4 + 1 + 4 + 8 + 4 + 4 + 4);
+	o9fs_rpcfree(fs, r);
 
 	/* So far the other fields are not used, don't bother parsing them */
+	stat->name = stat->uid = stat->gid = stat->muid = NULL;
 /*
-	p = fs->inbuf + Minhd + 2 + 2 + 2 + 4 + 1 + 4 + 8 + 4 + 4 + 4 + 8;
+	p = r->rx + Minhd + 2 + 2 + 2 + 4 + 1 + 4 + 8 + 4 + 4 + 4 + 8;
 	stat->name = o9fs_getstr(p, &sn);
 	p += sn+2;
 	stat->uid = o9fs_getstr(p, &sn);
@@ -150,18 +476,21 @@ o9fs_stat(struct o9fs *fs, struct o9fid *fid)
 	DBG("name %s uid %s gid %s muid %s\n", stat->name, stat->uid, stat->gid, stat->muid);
 */
 	DRET();
-	return stat;
+	return 0;
 }
 
 
 /*
- * Assume len is a sanitized length
+ * Assume len is a sanitized length.
+ * Data is moved from uio for Twrite and to uio for Tread.
  */
-uint32_t
-o9fs_rdwr(struct o9fs *fs, struct o9fid *f, uint8_t type, uint32_t len, uint64_t off)
+long
+o9fs_rdwr(struct o9fs *fs, struct o9fid *f, uint8_t type, struct uio *uio, uint32_t len, uint64_t off)
 {
+	struct o9req *r;
 	u_char *p;
 	long n;
+	int error;
 	DIN();
 
 	if (f == NULL) {
@@ -169,76 +498,281 @@ o9fs_rdwr(struct o9fs *fs, struct o9fid *f, uint8_t type, uint32_t len, uint64_t
 		return -1;
 	}
 
-	p = fs->outbuf;
+	/* Data is sent from and received into uio, see o9fs_rpc.c */
+	r = o9fs_rpcalloc(fs, Minhd + 4 + 8 + 4, Minhd + 4);
+	r->uio = uio;
+	r->conn = f->conn;
+	if (!(f->qid.type & O9FS_QTDIR))
+		r->bulk = len;
+	p = r->tx;
 	O9FS_PBIT8(p + Offtype, type);
-	O9FS_PBIT16(p + Offtag, o9fs_tag());
 	O9FS_PBIT32(p + Minhd, f->fid);
 	O9FS_PBIT64(p + Minhd + 4, off);
 	O9FS_PBIT32(p + Minhd + 4 + 8, len);
 
-	p += Minhd + 4 + 8 + 4;
+	n = Minhd + 4 + 8 + 4;
 	if (type == O9FS_TWRITE)
-		p += len;
-	n = p - fs->outbuf;
+		n += len;
 
-	O9FS_PBIT32(fs->outbuf, n);
-	n = o9fs_mio(fs, n);
+	O9FS_PBIT32(r->tx, n);
+	n = o9fs_rpc(fs, r);
 	if (n <= 0) {
+		/* Let the caller tell an interrupted or timed out request */
+		n = r->error == EINTR || r->error == ETIMEDOUT ? -r->error : -1;
+		o9fs_rpcfree(fs, r);
 		DRET();
-		return -1;
+		return n;
 	}
 
-	n = O9FS_GBIT32(fs->inbuf + Minhd);
+	n = O9FS_GBIT32(r->rx + Minhd);
+	if (type == O9FS_TREAD && !(r->flags & O9REQ_INUIO)) {
+		/* Another process read the reply for us */
+		if (n > len)
+			n = len;
+		error = uiomove(r->rx + Minhd + 4, n, uio);
+		if (error)
+			n = -1;
+	}
+	o9fs_rpcfree(fs, r);
 	DRET();
 	return n;
 }
 
 /*
- * Mode and perm in Unix convention.
+ * Walk fid from root back to its path on a new connection, after
+ * the old one was lost or fid was evicted, and open it again if it was open.
+ * Long paths take several Twalks, the later ones from fid to itself,
+ * -ENAMETOOLONG if a name does not fit in one.
  */
 int
-o9fs_opencreate(struct o9fs *fs, struct o9fid *fid, uint8_t type, uint32_t mode, uint32_t perm, char *name)
+o9fs_rewalk(struct o9fs *fs, struct o9fid *root, struct o9fid *fid)
 {
-	long n;
-	u_char *p;
-	uint32_t omode;
-	DIN();
+	struct o9fid *from;
+	struct o9req *r;
+	char *path, *s, *end, save;
+	long len;
+	int nwname, error;
 
-	if (fid == NULL) {
-		DRET();
+	if ((path = o9fs_joinpath(fid->path, NULL)) == NULL)
 		return -1;
+
+	from = root;
+	s = path;
+	for (;;) {
+		/* As many names as fit in one Twalk */
+		end = walkfit(fs, s, &nwname);
+		walkelem(s, &len);
+		if (nwname == 0 && len > 0) {
+			error = -ENAMETOOLONG;
+			break;
+		}
+		save = *end;
+		*end = '\0';
+		r = o9fs_twalk(fs, from, fid, s);
+		o9fs_rpc(fs, r);
+		error = o9fs_rwalk(fs, r, fid);
+		o9fs_rpcfree(fs, r);
+		*end = save;
+		if (error)
+			break;
+		from = fid;
+		s = end;
+		walkelem(s, &len);
+		if (len == 0)
+			break;
 	}
+	free(path, M_O9FS);
+
+	if (error == 0 && fid->mode != -1) {
+		/* Truncating again would lose what was written since */
+		r = o9fs_topencreate(fs, fid, O9FS_TOPEN, 0, 0, NULL);
+		O9FS_PBIT8(r->tx + O9FS_GBIT32(r->tx) - 1, fid->mode & ~O9FS_OTRUNC);
+		if (o9fs_rpc(fs, r) <= 0)
+			error = -1;
+		o9fs_rpcfree(fs, r);
+	}
+	return error;
+}
 
-	p = fs->outbuf;
+/*
+ * Mode and perm in Unix convention.
+ */
+struct o9req *
+o9fs_topencreate(struct o9fs *fs, struct o9fid *fid, uint8_t type, uint32_t mode, uint32_t perm, char *name)
+{
+	long n;
+	u_char *p;
+	struct o9req *r;
+
+	n = Minhd + 4 + 1;
+	if (type == O9FS_TCREATE)
+		n += 2 + strlen(name) + 4;
+	r = o9fs_rpcalloc(fs, n, Minhd + O9FS_QIDSZ + 4);
+	r->conn = fid->conn;
+	p = r->tx;
 	O9FS_PBIT8(p + Offtype, type);
-	O9FS_PBIT16(p + Offtag, o9fs_tag());
 	O9FS_PBIT32(p + Minhd, fid->fid);
 	p += Minhd + 4;
 
 	if (type == O9FS_TCREATE) {
-		if (name == NULL) {
-			DRET();
-			return -1;
-		}
 		p = o9fs_putstr(p, name);
 		O9FS_PBIT32(p, o9fs_utoperm(perm));
 		p += 4;
 	}
-	omode = o9fs_uflags2omode(mode);
-	O9FS_PBIT8(p, omode);
-	n = p + 1 - fs->outbuf;
+	O9FS_PBIT8(p, o9fs_uflags2omode(mode));
+	n = p + 1 - r->tx;
 
-	O9FS_PBIT32(fs->outbuf, n);
-	n = o9fs_mio(fs, n);
-	if (n <= 0) {
+	O9FS_PBIT32(r->tx, n);
+	return r;
+}
+
+int
+o9fs_ropencreate(struct o9fs *fs, struct o9req *r, struct o9fid *fid)
+{
+	if (r->error)
+		return -1;
+
+	fid->qid.type = O9FS_GBIT8(r->rx + Minhd);
+	fid->qid.vers = O9FS_GBIT32(r->rx + Minhd + 1);
+	fid->qid.path = O9FS_GBIT64(r->rx + Minhd + 1 + 4);
+	fid->iounit = O9FS_GBIT32(r->rx + Minhd + 1 + 4 + 8);
+	fid->mode = O9FS_GBIT8(r->tx + O9FS_GBIT32(r->tx) - 1);	/* omode is last */
+	fid->conn->nopen++;
+	o9fs_lrudel(fs, fid);
+	return 0;
+}
+
+/*
+ * The connection with the fewest open fids, to open fid on.
+ * Fid can only move to another one if it can be walked to from its root.
+ */
+static struct o9conn *
+o9fs_pickconn(struct o9fs *fs, struct o9fid *fid)
+{
+	struct o9conn *c, *best;
+
+	best = fid->conn;
+	if (fs->sess->nconn == 1 || !walkable(fs, fid->path))
+		return best;
+	for (c = fs->sess->conn; c < fs->sess->conn + fs->sess->nconn; c++)
+		if (!(c->flags & O9FS_DEAD) && c->nopen < best->nopen)
+			best = c;
+	return best;
+}
+
+/*
+ * Walk nf, a clone of fid made by o9fs_clonefid, and open it, in one
+ * round trip. It may be walked to on another connection, to spread the I/O.
+ * On error nf is left unknown to the server, and minus the error of the
+ * request that failed is returned, or -1.
+ */
+int
+o9fs_walkopen(struct o9fs *fs, struct o9fid *fid, struct o9fid *nf, uint32_t mode)
+{
+	struct o9conn *c;
+	struct o9req *r[2];
+	int error, fromroot;
+	DIN();
+
+	if (fid == NULL || nf == NULL) {
 		DRET();
 		return -1;
 	}
 
-	fid->qid.type = O9FS_GBIT8(fs->inbuf + Minhd);
-	fid->qid.vers = O9FS_GBIT32(fs->inbuf + Minhd + 1);
-	fid->qid.path = O9FS_GBIT64(fs->inbuf + Minhd + 1 + 4);
-	fid->iounit = O9FS_GBIT32(fs->inbuf + Minhd + 1 + 4 + 8);
-	fid->mode = omode;
-	return 0;
+	/* A fid the server does not know is not walked to just to be cloned */
+	c = o9fs_pickconn(fs, fid);
+	fromroot = c != fid->conn ||
+	    ((fid->flags & (O9FID_EVICTED | O9FID_LAZY)) && walkable(fs, fid->path));
+	if (!fromroot && o9fs_fiduse(fs, fid) < 0) {
+		DRET();
+		return -1;
+	}
+	if (!fromroot)
+		r[0] = o9fs_twalk(fs, fid, nf, NULL);
+	else
+		r[0] = o9fs_twalk(fs, fs->root[c - fs->sess->conn], nf, fid->path);
+	r[1] = o9fs_topencreate(fs, nf, O9FS_TOPEN, mode, 0, NULL);
+	o9fs_rpcv(fs, r, 2);
+	if (!fromroot)
+		o9fs_fidrele(fs, fid);
+
+	error = 0;
+	if (o9fs_rwalk(fs, r[0], nf) < 0)
+		error = r[0]->error ? -r[0]->error : -ENOENT;
+	else if (o9fs_ropencreate(fs, r[1], nf) < 0) {
+		DBG("failed open\n");
+		o9fs_clunkremove(fs, nf, O9FS_TCLUNK);
+		error = r[1]->error ? -r[1]->error : -1;
+	}
+
+	o9fs_rpcfree(fs, r[0]);
+	o9fs_rpcfree(fs, r[1]);
+	DRET();
+	return error;
+}
+
+/*
+ * Create name in the directory fid and return the fid of the create,
+ * open with mode. Clone and create go in one round trip.
+ */
+struct o9fid *
+o9fs_walkcreate(struct o9fs *fs, struct o9fid *fid, char *name, uint32_t perm, uint32_t mode)
+{
+	struct o9fid *cf;
+	struct o9req *r[2];
+	DIN();
+
+	if (fid == NULL || name == NULL) {
+		DRET();
+		return NULL;
+	}
+
+	cf = o9fs_clonefid(fs, fid);
+	if (o9fs_fiduse(fs, fid) < 0) {
+		o9fs_putfid(fs, cf);
+		DRET();
+		return NULL;
+	}
+	r[0] = o9fs_twalk(fs, fid, cf, NULL);
+	r[1] = o9fs_topencreate(fs, cf, O9FS_TCREATE, mode, perm, name);
+	o9fs_rpcv(fs, r, 2);
+	o9fs_fidrele(fs, fid);
+
+	if (o9fs_rwalk(fs, r[0], cf) < 0) {
+		o9fs_putfid(fs, cf);
+		cf = NULL;
+	} else if (o9fs_ropencreate(fs, r[1], cf) < 0) {
+		o9fs_clunkremove(fs, cf, O9FS_TCLUNK);
+		o9fs_putfid(fs, cf);
+		cf = NULL;
+	} else {
+		if (cf->path != NULL)
+			free(cf->path, M_O9FS);
+		cf->path = o9fs_joinpath(fid->path, name);
+	}
+
+	o9fs_rpcfree(fs, r[0]);
+	o9fs_rpcfree(fs, r[1]);
+	DRET();
+	return cf;
+}
+
+/*
+ * An unopened fid for the file of f, which the server only
+ * learns about when it is first used, see o9fs_fiduse.
+ * Nil if it could not be walked to from the root.
+ */
+struct o9fid *
+o9fs_lazyfid(struct o9fs *fs, struct o9fid *f)
+{
+	struct o9fid *nf;
+
+	if (f->path == NULL)
+		return NULL;
+	nf = o9fs_getfid(fs);
+	nf->conn = f->conn;
+	nf->path = o9fs_joinpath(f->path, NULL);
+	nf->qid = f->qid;
+	o9fs_fidlazy(fs, nf);
+	return nf;
 }
@@ -2,6 +2,7 @@
 #include <sys/param.h>
 #include <sys/systm.h>
 #include <sys/malloc.h>
+#include <sys/rwlock.h>
 
 #include "o9fs.h"
 #include "o9fs_extern.h"
@@ -3,27 +3,66 @@ void	o9fs_dump(u_char *, long);
 char	*o9fs_putstr(char *, char *);
 char	*o9fs_getstr(char *);
 int		o9fs_allocvp(struct mount *, struct o9fid *, struct vnode **, u_long);
+int		o9fs_nodeget(struct o9fs *, struct o9fid *, struct vnode **, u_long);
+void	o9fs_nodeunhash(struct o9node *);
+void	o9fs_attrcheck(struct o9node *, struct o9qid *);
+int		o9fs_vget(struct mount *, ino_t, struct vnode **);
+void	o9fs_dirpurge(struct o9fs *, struct o9node *);
+void	o9fs_dirsave(struct o9fs *, struct o9node *, struct o9stat *, int);
+int		o9fs_dirabsent(struct o9fs *, struct o9node *, char *, size_t);
 struct	o9fid *o9fs_getfid(struct o9fs *);
 void	o9fs_putfid(struct o9fs *, struct o9fid *);
-int		o9fs_ptoumode(int);
+void	o9fs_lruadd(struct o9fs *, struct o9fid *);
+void	o9fs_lrudel(struct o9fs *, struct o9fid *);
+int		o9fs_fiduse(struct o9fs *, struct o9fid *);
+void	o9fs_fidrele(struct o9fs *, struct o9fid *);
+void	o9fs_fidlazy(struct o9fs *, struct o9fid *);
+struct	o9fid *o9fs_fidlookup(struct o9fs *, int32_t);
+int		o9fs_permtou(int);
 int		o9fs_utoperm(int);
 int		o9fs_uflags2omode(uint32_t);
 void	*o9fsrealloc(void *, size_t, size_t);
 void	_printvp(struct vnode *);
-long	o9fs_mio(struct o9fs *, u_long);
-uint16_t	o9fs_tag(void);
 uint32_t	o9fs_sanelen(struct o9fs *, uint32_t);
 
+/* o9fs_rpc.c */
+void	o9fs_rpcinit(struct o9fs *, struct o9conn *);
+void	o9fs_rpcreset(struct o9fs *, struct o9conn *, struct file *);
+void	o9fs_rpcresume(struct o9conn *, int);
+int		o9fs_ringattach(struct o9conn *, struct file *);
+void	o9fs_ringdetach(struct o9conn *);
+long	o9fs_rpc(struct o9fs *, struct o9req *);
+int		o9fs_rpcv(struct o9fs *, struct o9req **, int);
+struct	o9req *o9fs_rpcalloc(struct o9fs *, u_long, u_long);
+void	o9fs_rpcfree(struct o9fs *, struct o9req *);
+void	o9fs_rpcpurge(struct o9sess *);
+void	*o9fs_bufalloc(struct o9fs *, u_long, u_long *);
+void	o9fs_buffree(struct o9fs *, void *, u_long);
+void	o9fs_getstats(struct o9fs *, struct o9fsstats *);
+
 /* o9fs_9p.c */
-uint32_t	o9fs_rdwr(struct o9fs *, struct o9fid *, uint8_t, uint32_t, uint64_t);
-int		o9fs_opencreate(struct o9fs *, struct o9fid *, uint8_t, uint32_t, uint32_t, char *);
+long	o9fs_rdwr(struct o9fs *, struct o9fid *, uint8_t, struct uio *, uint32_t, uint64_t);
+char	*o9fs_joinpath(char *, char *);
+struct	o9req *o9fs_tclunkremove(struct o9fs *, struct o9fid *, uint8_t);
+struct	o9req *o9fs_twalk(struct o9fs *, struct o9fid *, struct o9fid *, char *);
+int		o9fs_rewalk(struct o9fs *, struct o9fid *, struct o9fid *);
+int		o9fs_rwalk(struct o9fs *, struct o9req *, struct o9fid *);
+struct	o9req *o9fs_topencreate(struct o9fs *, struct o9fid *, uint8_t, uint32_t, uint32_t, char *);
+int		o9fs_ropencreate(struct o9fs *, struct o9req *, struct o9fid *);
+struct	o9fid *o9fs_clonefid(struct o9fs *, struct o9fid *);
 struct	o9fid *o9fs_walk(struct o9fs *, struct o9fid *, struct o9fid *, char *);
+int		o9fs_walkpath(struct o9fs *, struct o9fid *, struct o9fid *, char *, struct o9qid *, int *);
+int		o9fs_walkopen(struct o9fs *, struct o9fid *, struct o9fid *, uint32_t);
+struct	o9fid *o9fs_walkcreate(struct o9fs *, struct o9fid *, char *, uint32_t, uint32_t);
+struct	o9fid *o9fs_lazyfid(struct o9fs *, struct o9fid *);
 void	o9fs_clunkremove(struct o9fs *, struct o9fid *, uint8_t);
-struct	o9stat *o9fs_stat(struct o9fs *, struct o9fid *);
+void	o9fs_clunkdefer(struct o9fs *, struct o9fid *);
+int		o9fs_stat(struct o9fs *, struct o9fid *, struct o9stat *);
 
 /* o9fs_convM2D.c */
 int		o9fs_statcheck(u_char *, u_int);
 u_int	o9fs_convM2D(u_char *, u_int, struct o9stat *, char *);
 
 extern uint8_t verbose;
+extern struct pool o9fs_fidpool;
 extern struct vops o9fs_vops;
@@ -5,6 +5,8 @@
 #include <sys/mount.h>
 #include <sys/exec.h>
 #include <sys/lkm.h>
+#include <sys/pool.h>
+#include <sys/rwlock.h>
 
 #include "o9fs.h"
 #include "o9fs_extern.h"
@@ -19,8 +21,18 @@ extern struct vfsops o9fs_vfsops;
 struct vfsconf o9fs_vfsconf = { &o9fs_vfsops, MOUNT_O9FS, 0, 0, 0, NULL };
 MOD_VFS("o9fs", -1, &o9fs_vfsconf);
 
+/* The fid pool is set up by o9fs_init when the vfs is registered */
+static int
+o9fs_unload(struct lkm_table *table, int cmd)
+{
+	if (o9fs_vfsconf.vfc_refcount > 0)
+		return EBUSY;
+	pool_destroy(&o9fs_fidpool);
+	return 0;
+}
+
 int
 o9fs_lkmentry(struct lkm_table *table, int cmd, int ver)
 {
-	DISPATCH(table, cmd, ver, lkm_nofunc, lkm_nofunc, lkm_nofunc);
+	DISPATCH(table, cmd, ver, lkm_nofunc, o9fs_unload, lkm_nofunc);
 }
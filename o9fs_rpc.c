@@ -0,0 +1,1451 @@
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/proc.h>
+#include <sys/file.h>
+#include <sys/malloc.h>
+#include <sys/mbuf.h>
+#include <sys/socket.h>
+#include <sys/socketvar.h>
+#include <sys/signalvar.h>
+#include <sys/rwlock.h>
+#include <sys/queue.h>
+#include <sys/vnode.h>
+
+#include <uvm/uvm_extern.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "o9fs.h"
+#include "o9fs_extern.h"
+#include "ring/o9ring.h"
+
+enum{
+	Debug = 0,
+};
+
+static const int maxfree[Nbclass] = { 64, 16, 4 };	/* Free buffers kept by class */
+
+/*
+ * Any number of requests, up to Ntag, may be outstanding on a connection.
+ * There is no receiving thread. Instead, the first process waiting
+ * for a reply becomes the reader: it reads R-messages and hands each
+ * one to the request with the matching tag until its own reply shows
+ * up, then wakes up the next waiter to take over.
+ *
+ * A request whose process gets a signal, or whose mount timeout runs
+ * out, is abandoned with a Tflush. Over a socket the reader polls every
+ * Rdpoll ticks so that it notices too; a read is never given up in the
+ * middle of a message, or the connection would be out of sync.
+ */
+
+#define Rdpoll	(hz / 4)
+
+static long
+rdwr(struct o9conn *c, void *buf, long count, off_t *offset, int write)
+{
+	struct file *fp;
+	struct uio auio;
+	struct iovec aiov;
+	long cnt;
+	int error;
+
+	error = 0;
+	fp = c->fp;
+	aiov.iov_base = buf;
+	cnt = aiov.iov_len = auio.uio_resid = count;
+	auio.uio_iov = &aiov;
+	auio.uio_iovcnt = 1;
+	auio.uio_segflg = UIO_SYSSPACE;
+	auio.uio_procp = curproc;
+
+	if (write) {
+		auio.uio_rw = UIO_WRITE;
+		error = (*fp->f_ops->fo_write)(fp, offset, &auio, fp->f_cred);
+		cnt -= auio.uio_resid;
+
+		fp->f_wxfer++;
+		fp->f_wbytes += cnt;
+	} else {
+		auio.uio_rw = UIO_READ;
+		error = (*fp->f_ops->fo_read)(fp, offset, &auio, fp->f_cred);
+		cnt -= auio.uio_resid;
+
+		fp->f_rxfer++;
+		fp->f_rbytes += cnt;
+	}
+	if (error == ERESTART)
+		error = EINTR;
+	if (error)
+		return -error;
+	return cnt;
+}
+
+/*
+ * Whether a read that got nothing should be tried again.
+ */
+static int
+rdretry(struct o9conn *c, int error)
+{
+	if (error == EWOULDBLOCK)
+		return 1;
+	if (error == EINTR || error == ERESTART) {
+		/* The signal is still pending, do not spin on it */
+		tsleep(&c->fp, PRIBIO, "o9fsrd", 1);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Read exactly n bytes, the server may hand them over in pieces.
+ */
+static int
+readn(struct o9conn *c, void *buf, long n)
+{
+	u_char *p;
+	long m;
+
+	for (p = buf; n > 0; p += m, n -= m) {
+		m = rdwr(c, p, n, &c->fp->f_offset, 0);
+		if (m < 0 && rdretry(c, -m)) {
+			m = 0;
+			continue;
+		}
+		if (m < 0)
+			return -m;
+		if (m == 0)
+			return EPIPE;
+	}
+	return 0;
+}
+
+/*
+ * Twrite data is not copied to tx but sent straight from r->uio.
+ * Over a socket, the header and the data go in one mbuf chain,
+ * built by o9fs_mwrite before taking the send lock.
+ */
+static struct mbuf *
+o9fs_mwrite(struct o9req *r, long hdlen, long n, int *error)
+{
+	struct mbuf *top, *m, **mp;
+	long len;
+
+	MGETHDR(top, M_WAIT, MT_DATA);
+	memcpy(mtod(top, caddr_t), r->tx, hdlen);
+	top->m_len = hdlen;
+	top->m_pkthdr.len = hdlen + n;
+
+	mp = &top->m_next;
+	while (n > 0) {
+		MGET(m, M_WAIT, MT_DATA);
+		len = MLEN;
+		if (n >= MINCLSIZE) {
+			MCLGET(m, M_WAIT);
+			if (m->m_flags & M_EXT)
+				len = MCLBYTES;
+		}
+		len = MIN(len, n);
+		*mp = m;
+		mp = &m->m_next;
+		*error = uiomove(mtod(m, caddr_t), len, r->uio);
+		if (*error) {
+			m_freem(top);
+			return NULL;
+		}
+		m->m_len = len;
+		n -= len;
+	}
+	*error = 0;
+	return top;
+}
+
+/*
+ * Send r->tx, followed by the Twrite data in r->uio if any,
+ * with the send lock held. top is the mbuf chain from o9fs_mwrite.
+ */
+static int
+o9fs_send(struct o9conn *c, struct o9req *r, struct mbuf *top)
+{
+	struct file *fp;
+	long len, hdlen, n;
+	size_t resid;
+	int error;
+
+	fp = c->fp;
+	len = O9FS_GBIT32(r->tx);
+	if (O9FS_GBIT8(r->tx + Offtype) != O9FS_TWRITE)
+		return rdwr(c, r->tx, len, &fp->f_offset, 1) == len ? 0 : EIO;
+
+	if (top != NULL) {
+		error = sosend((struct socket *)fp->f_data, NULL, NULL, top, NULL, 0);
+		if (error == 0) {
+			fp->f_wxfer++;
+			fp->f_wbytes += len;
+		}
+		return error;
+	}
+
+	hdlen = Minhd + 4 + 8 + 4;
+	n = rdwr(c, r->tx, hdlen, &c->fp->f_offset, 1);
+	if (n != hdlen)
+		return n < 0 ? -n : EIO;
+
+	/* Not a socket: write the data from the caller's uio */
+	resid = r->uio->uio_resid;
+	r->uio->uio_resid = len - hdlen;
+	error = (*fp->f_ops->fo_write)(fp, &fp->f_offset, r->uio, fp->f_cred);
+	n = len - hdlen - r->uio->uio_resid;
+	r->uio->uio_resid = resid - n;
+	fp->f_wxfer++;
+	fp->f_wbytes += n;
+	if (error == 0 && n != len - hdlen)
+		error = EIO;
+	return error;
+}
+
+/*
+ * Requests take turns to send in two queues. Metadata (walks, stats,
+ * opens, directory reads, flushes...) always goes first. Bulk requests,
+ * Tread and Twrite of files, go in arrival order and only while less
+ * than bulkmax bytes of them are in flight on the connection, so that
+ * a large copy cannot fill the socket and the server ahead of an ls.
+ * A process has one batch waiting at a time, which makes arrival order
+ * share the connection fairly among processes.
+ */
+
+/* Wake up the batch whose turn it is, if the connection is free */
+static void
+o9fs_schedkick(struct o9conn *c)
+{
+	struct o9req *r;
+
+	if (c->flags & O9FS_SNDLOCK)
+		return;
+	if ((r = TAILQ_FIRST(&c->sndq[Smeta])) == NULL)
+		r = TAILQ_FIRST(&c->sndq[Sbulk]);
+	if (r != NULL)
+		wakeup(&r->sndnext);
+}
+
+/*
+ * Wait for the turn of the batch of n requests in r
+ * and take the send lock of their connection.
+ */
+static int
+o9fs_schedin(struct o9fs *fs, struct o9req **r, int n)
+{
+	struct o9conn *c;
+	long bulk;
+	int catch, error, i, q;
+
+	c = r[0]->conn;
+	bulk = 0;
+	for (i = 0; i < n; i++)
+		bulk += r[i]->bulk;
+	q = bulk ? Sbulk : Smeta;
+
+	/* A Tflush cannot be given up, and is the most urgent of all */
+	catch = PCATCH;
+	if (O9FS_GBIT8(r[0]->tx + Offtype) == O9FS_TFLUSH) {
+		catch = 0;
+		TAILQ_INSERT_HEAD(&c->sndq[q], r[0], sndnext);
+	} else
+		TAILQ_INSERT_TAIL(&c->sndq[q], r[0], sndnext);
+
+	error = 0;
+	for (;;) {
+		if (c->flags & O9FS_DEAD) {
+			error = EIO;
+			break;
+		}
+		if (!(c->flags & O9FS_SNDLOCK) && TAILQ_FIRST(&c->sndq[q]) == r[0] &&
+		    (q == Smeta || (TAILQ_EMPTY(&c->sndq[Smeta]) &&
+		    (c->bulk == 0 || c->bulk + bulk <= fs->sess->bulkmax))))
+			break;
+		if (tsleep(&r[0]->sndnext, PRIBIO | catch, "o9fssnd", 0) != 0) {
+			error = EINTR;
+			break;
+		}
+	}
+
+	TAILQ_REMOVE(&c->sndq[q], r[0], sndnext);
+	if (error) {
+		o9fs_schedkick(c);
+		return error;
+	}
+	c->flags |= O9FS_SNDLOCK;
+	c->bulk += bulk;
+	return 0;
+}
+
+static void
+o9fs_sndunlock(struct o9conn *c)
+{
+	c->flags &= ~O9FS_SNDLOCK;
+	o9fs_schedkick(c);
+}
+
+static int
+o9fs_tagalloc(struct o9conn *c, struct o9req *r)
+{
+	int i, t;
+
+	for (;;) {
+		if (c->flags & O9FS_DEAD)
+			return EIO;
+
+		/* Do not hand out a tag just freed, the server may still be flushing it */
+		for (i = 0; i < Ntag; i++) {
+			t = (c->nexttag + i) % Ntag;
+			if (c->tags[t] == NULL) {
+				c->tags[t] = r;
+				c->nexttag = t + 1;
+				r->tag = t;
+				return 0;
+			}
+		}
+		c->flags |= O9FS_WANTTAG;
+		tsleep(&c->tags, PRIBIO, "o9fstag", 0);
+	}
+}
+
+static void
+o9fs_tagfree(struct o9conn *c, struct o9req *r)
+{
+	if (r->tag < Ntag && c->tags[r->tag] == r)
+		c->tags[r->tag] = NULL;
+	if (c->flags & O9FS_WANTTAG) {
+		c->flags &= ~O9FS_WANTTAG;
+		wakeup(&c->tags);
+	}
+}
+
+static struct o9req *
+o9fs_tagreq(struct o9conn *c, uint16_t tag)
+{
+	struct o9req *r;
+
+	if (tag < Ntag)
+		return c->tags[tag];
+
+	/* Only Tversion goes without a tag table entry */
+	TAILQ_FOREACH(r, &c->reqq, next)
+		if (r->tag == tag)
+			return r;
+	return NULL;
+}
+
+/*
+ * The connection is unusable, fail everybody waiting on it.
+ */
+static void
+o9fs_rpcabort(struct o9fs *fs, struct o9conn *c, int error)
+{
+	struct o9req *r;
+
+	printf("o9fs: connection %d to %s lost, error %d\n",
+	    (int)(c - fs->sess->conn), fs->sess->name, error);
+	c->flags |= O9FS_DEAD;
+	TAILQ_FOREACH(r, &c->reqq, next) {
+		if (r->flags & O9REQ_DONE)
+			continue;
+		r->error = error;
+		r->flags |= O9REQ_DONE | O9REQ_LOST;
+		wakeup(r);
+	}
+	TAILQ_FOREACH(r, &c->sndq[Smeta], sndnext)
+		wakeup(&r->sndnext);
+	TAILQ_FOREACH(r, &c->sndq[Sbulk], sndnext)
+		wakeup(&r->sndnext);
+	wakeup(&c->tags);
+}
+
+/*
+ * Read the data of an Rread straight into r->uio.
+ * hd holds the message header, already read.
+ */
+static int
+o9fs_recvuio(struct o9conn *c, struct o9req *r, u_char *hd, uint32_t len)
+{
+	struct file *fp;
+	struct uio *uio;
+	u_char junk[64];
+	uint32_t n, m;
+	size_t resid;
+	int error;
+
+	fp = c->fp;
+	uio = r->uio;
+	if (len < Minhd + 4 || len - Minhd - 4 > O9FS_GBIT32(r->tx + Minhd + 4 + 8)) {
+		printf("Rread with length %d\n", len);
+		return EIO;
+	}
+
+	memcpy(r->rx, hd, Minhd);
+	if ((error = readn(c, r->rx + Minhd, 4)) != 0)
+		return error;
+	n = O9FS_GBIT32(r->rx + Minhd);
+	if (n != len - Minhd - 4) {
+		printf("Rread count %d in a message of %d bytes\n", n, len);
+		return EIO;
+	}
+
+	resid = uio->uio_resid;
+	uio->uio_resid = n;
+	error = 0;
+	while (uio->uio_resid > 0) {
+		m = uio->uio_resid;
+		error = (*fp->f_ops->fo_read)(fp, &fp->f_offset, uio, fp->f_cred);
+		m -= uio->uio_resid;
+		fp->f_rxfer++;
+		fp->f_rbytes += m;
+		if (m == 0 && error && rdretry(c, error))
+			continue;
+		if (error)
+			break;
+		if (m == 0) {
+			error = EPIPE;
+			break;
+		}
+	}
+	m = uio->uio_resid;
+	uio->uio_resid = resid - (n - m);
+
+	if (error == EFAULT) {
+		/* The caller's fault, keep the connection in sync */
+		r->error = error;
+		for (; m > 0; m -= n) {
+			n = MIN(m, sizeof(junk));
+			if ((error = readn(c, junk, n)) != 0)
+				return error;
+		}
+	} else if (error)
+		return error;
+
+	r->flags |= O9REQ_DONE | O9REQ_INUIO;
+	wakeup(r);
+	return 0;
+}
+
+/*
+ * Over a ring shared with a local server (see ring/o9ring.h) messages
+ * are copied in and out of its slots instead of going through the
+ * socket, which is left as the bell of both sides: a byte written to
+ * it wakes up the other side if its waiting flag is set. A batch of
+ * requests is posted with a single bell at most, and the reader takes
+ * every reply in the ring before handing the slots back.
+ *
+ * The reader sleeps on the socket like over a plain connection, so
+ * signals and timeouts are noticed the same way. A sender finding
+ * the T ring full polls every tick instead, the reader may be busy
+ * with the socket.
+ */
+
+/* Orders our accesses to the region against the server's */
+#ifdef __amd64__
+#define membar()	__asm __volatile("lock; addl $0,0(%%rsp)" ::: "memory")
+#else
+#define membar()	__asm __volatile("lock; addl $0,0(%%esp)" ::: "memory")
+#endif
+
+enum {
+	Ringspin = 256,		/* Polls of an empty ring before sleeping */
+};
+
+/*
+ * Wake the server if it went to sleep, flag is its waiting flag.
+ */
+static void
+ringbell(struct o9conn *c, volatile uint32_t *flag)
+{
+	struct uio auio;
+	struct iovec aiov;
+	char b;
+
+	membar();
+	if (*flag == 0)
+		return;
+	c->ring->nbell++;
+	b = 0;
+	aiov.iov_base = &b;
+	aiov.iov_len = auio.uio_resid = 1;
+	auio.uio_iov = &aiov;
+	auio.uio_iovcnt = 1;
+	auio.uio_segflg = UIO_SYSSPACE;
+	auio.uio_rw = UIO_WRITE;
+	auio.uio_procp = curproc;
+
+	/* A full socket means the server has a wakeup pending anyway */
+	sosend((struct socket *)c->fp->f_data, NULL, &auio, NULL, NULL, MSG_DONTWAIT);
+}
+
+/* Publish the T-messages posted so far, with the send lock held */
+static void
+ringflush(struct o9conn *c)
+{
+	struct o9kring *rg;
+	struct o9ringidx *x;
+
+	rg = c->ring;
+	x = &rg->hdr->idx[O9RING_T];
+	if (x->head == rg->head)
+		return;
+	membar();
+	x->head = rg->head;
+	ringbell(c, &x->cwait);
+}
+
+/* Hand the slots of the R-messages taken back, as the reader */
+static void
+ringrelease(struct o9conn *c)
+{
+	struct o9kring *rg;
+	struct o9ringidx *x;
+
+	rg = c->ring;
+	x = &rg->hdr->idx[O9RING_R];
+	if (x->tail == rg->tail)
+		return;
+	membar();
+	x->tail = rg->tail;
+	ringbell(c, &x->pwait);
+}
+
+/*
+ * Post the n requests in r on the ring of c and publish them,
+ * with the send lock held. Twrite data comes straight from r->uio
+ * as in o9fs_send; a request whose data cannot be copied in is
+ * not posted and fails on its own.
+ */
+static int
+o9fs_ringsend(struct o9fs *fs, struct o9conn *c, struct o9req **r, int n)
+{
+	struct o9kring *rg;
+	struct o9ringidx *x;
+	u_char *p;
+	long len, hdlen;
+	int deadline, error, i;
+
+	rg = c->ring;
+	x = &rg->hdr->idx[O9RING_T];
+	deadline = ticks + fs->sess->timeout;
+	for (i = 0; i < n; i++) {
+		while (rg->head - x->tail >= rg->nslot) {
+			ringflush(c);
+			if (c->flags & O9FS_DEAD)
+				return EIO;
+			if (fs->sess->timeout != 0 && deadline - ticks <= 0)
+				return ETIMEDOUT;
+			tsleep(rg, PRIBIO, "o9fsring", 1);
+		}
+
+		p = rg->slots[O9RING_T] + (rg->head & (rg->nslot - 1)) * rg->slotsize;
+		len = O9FS_GBIT32(r[i]->tx);
+		if (O9FS_GBIT8(r[i]->tx + Offtype) != O9FS_TWRITE) {
+			memcpy(p, r[i]->tx, len);
+			rg->head++;
+			continue;
+		}
+
+		hdlen = Minhd + 4 + 8 + 4;
+		memcpy(p, r[i]->tx, hdlen);
+		if ((error = uiomove(p + hdlen, len - hdlen, r[i]->uio)) != 0) {
+			r[i]->error = error;
+			r[i]->flags |= O9REQ_DONE;
+			continue;
+		}
+		rg->head++;
+	}
+	ringflush(c);
+	return 0;
+}
+
+/*
+ * o9fs_recv over the ring of c: take the next R-message, sleeping
+ * on the bell for up to Rdpoll ticks if there is none.
+ */
+static int
+o9fs_ringrecv(struct o9fs *fs, struct o9conn *c)
+{
+	struct o9kring *rg;
+	struct o9ringidx *x;
+	struct o9req *r;
+	u_char *p, bell[64];
+	uint32_t len, n;
+	long m;
+	int i;
+
+	rg = c->ring;
+	x = &rg->hdr->idx[O9RING_R];
+	for (i = 0; rg->tail == x->head; i++) {
+		if (i < Ringspin)
+			continue;
+
+		/* The server may be waiting for the slots taken so far */
+		ringrelease(c);
+		x->cwait = 1;
+		membar();
+		if (rg->tail != x->head)
+			break;
+		rg->nsleep++;
+		m = rdwr(c, bell, sizeof(bell), &c->fp->f_offset, 0);
+		x->cwait = 0;
+		if (m == -EWOULDBLOCK || m == -EINTR)
+			return -m;
+		if (m <= 0)
+			return m == 0 ? EPIPE : -m;
+	}
+	x->cwait = 0;
+	membar();
+
+	p = rg->slots[O9RING_R] + (rg->tail++ & (rg->nslot - 1)) * rg->slotsize;
+	len = O9FS_GBIT32(p);
+	if (len < Minhd || len > rg->slotsize) {
+		printf("R-message with length %d in the ring\n", len);
+		return EIO;
+	}
+
+	r = o9fs_tagreq(c, O9FS_GBIT16(p + Offtag));
+	if (r == NULL) {
+		DBG("dropping R-message tag %d len %d\n", O9FS_GBIT16(p + Offtag), len);
+		return 0;
+	}
+
+	/* As in o9fs_recv, only the reader's own process takes Rread data in place */
+	if (r->uio != NULL && O9FS_GBIT8(p + Offtype) == O9FS_RREAD &&
+	    (r->uio->uio_segflg == UIO_SYSSPACE || r->uio->uio_procp == curproc)) {
+		if (len < Minhd + 4 || (n = O9FS_GBIT32(p + Minhd)) != len - Minhd - 4 ||
+		    n > O9FS_GBIT32(r->tx + Minhd + 4 + 8)) {
+			printf("Rread with length %d\n", len);
+			return EIO;
+		}
+		memcpy(r->rx, p, Minhd + 4);
+		r->error = uiomove(p + Minhd + 4, n, r->uio);
+		r->flags |= O9REQ_DONE | O9REQ_INUIO;
+		wakeup(r);
+		return 0;
+	}
+
+	if (len > r->rxsize && len <= fs->sess->msize) {
+		o9fs_buffree(fs, r->rx, r->rxsize);
+		r->rx = o9fs_bufalloc(fs, len, &r->rxsize);
+	}
+	if (len > r->rxsize)
+		r->error = EMSGSIZE;
+	else
+		memcpy(r->rx, p, len);
+	r->flags |= O9REQ_DONE;
+	wakeup(r);
+	return 0;
+}
+
+/*
+ * Put c over the ring in fp, a file the server laid out with
+ * o9ring_init and maps shared. The region is wired into the kernel
+ * map until o9fs_ringdetach, and the socket of c becomes its bell.
+ * Takes over the reference to fp, even on error.
+ */
+int
+o9fs_ringattach(struct o9conn *c, struct file *fp)
+{
+	struct o9kring *rg;
+	struct o9ringhdr hdr;
+	struct uvm_object *uobj;
+	struct vattr va;
+	struct vnode *vp;
+	vaddr_t kva;
+	vsize_t size;
+	int error;
+
+	error = EINVAL;
+	if (c->fp->f_type != DTYPE_SOCKET || fp->f_type != DTYPE_VNODE)
+		goto bad;
+	vp = (struct vnode *)fp->f_data;
+	if (vp->v_type != VREG)
+		goto bad;
+
+	error = vn_rdwr(UIO_READ, vp, (caddr_t)&hdr, sizeof(hdr), 0, UIO_SYSSPACE,
+	    0, fp->f_cred, NULL, curproc);
+	if (error)
+		goto bad;
+	error = EINVAL;
+	if (hdr.magic != O9RING_MAGIC || hdr.nslot == 0 || (hdr.nslot & (hdr.nslot - 1)) != 0 ||
+	    hdr.slotsize < O9FS_MINMSIZE || hdr.slotsize > O9FS_MAXMSIZE ||
+	    hdr.nslot > O9FS_MAXRING / 2 / hdr.slotsize)
+		goto bad;
+	size = sizeof(hdr) + 2 * (vsize_t)hdr.nslot * hdr.slotsize;
+	if ((error = VOP_GETATTR(vp, &va, fp->f_cred, curproc)) != 0)
+		goto bad;
+	if (va.va_size < size) {
+		error = EINVAL;
+		goto bad;
+	}
+
+	size = round_page(size);
+	if ((uobj = uvn_attach(vp, VM_PROT_READ | VM_PROT_WRITE)) == NULL) {
+		error = ENOMEM;
+		goto bad;
+	}
+	kva = vm_map_min(kernel_map);
+	error = uvm_map(kernel_map, &kva, size, uobj, 0, 0,
+	    UVM_MAPFLAG(UVM_PROT_RW, UVM_PROT_RW, UVM_INH_NONE, UVM_ADV_RANDOM, 0));
+	if (error) {
+		uobj->pgops->pgo_detach(uobj);
+		goto bad;
+	}
+	if ((error = uvm_map_pageable(kernel_map, kva, kva + size, FALSE, 0)) != 0) {
+		uvm_unmap(kernel_map, kva, kva + size);
+		goto bad;
+	}
+
+	rg = malloc(sizeof(struct o9kring), M_O9FS, M_WAITOK | M_ZERO);
+	rg->hdr = (struct o9ringhdr *)kva;
+	rg->nslot = hdr.nslot;
+	rg->slotsize = hdr.slotsize;
+	rg->slots[O9RING_T] = (u_char *)kva + sizeof(hdr);
+	rg->slots[O9RING_R] = rg->slots[O9RING_T] + (size_t)rg->nslot * rg->slotsize;
+	rg->head = rg->hdr->idx[O9RING_T].head;
+	rg->tail = rg->hdr->idx[O9RING_R].tail;
+	rg->size = size;
+	rg->fp = fp;
+	c->ring = rg;
+	return 0;
+
+bad:
+	FRELE(fp);
+	return error;
+}
+
+/*
+ * Unwire and unmap the ring of c, if any; c goes back to its socket.
+ */
+void
+o9fs_ringdetach(struct o9conn *c)
+{
+	struct o9kring *rg;
+	vaddr_t kva;
+
+	if ((rg = c->ring) == NULL)
+		return;
+	c->ring = NULL;
+	kva = (vaddr_t)rg->hdr;
+	uvm_unmap(kernel_map, kva, kva + rg->size);
+	FRELE(rg->fp);
+	free(rg, M_O9FS);
+}
+
+/*
+ * Read one R-message and give it to the request waiting on its tag.
+ * Replies nobody is waiting for are read and dropped.
+ */
+static int
+o9fs_recv(struct o9fs *fs, struct o9conn *c)
+{
+	struct o9req *r;
+	u_char hd[Minhd], junk[64];
+	uint32_t len, n;
+	uint16_t tag;
+	long m;
+	int error;
+
+	if (c->ring != NULL)
+		return o9fs_ringrecv(fs, c);
+
+	m = rdwr(c, hd, Minhd, &c->fp->f_offset, 0);
+	if (m == -EWOULDBLOCK || m == -EINTR)
+		return -m;		/* Nothing read yet, let the reader look around */
+	error = m < 0 ? -m : 0;
+	if (m == 0)
+		error = EPIPE;
+	else if (m > 0 && m < Minhd)
+		error = readn(c, hd + m, Minhd - m);
+	if (error) {
+		printf("o9fs_recv: Error reading message header\n");
+		return error;
+	}
+
+	len = O9FS_GBIT32(hd);
+	if (len < Minhd) {
+		printf("R-message with length < %d\n", Minhd);
+		return EIO;
+	}
+
+	tag = O9FS_GBIT16(hd + Offtag);
+	r = o9fs_tagreq(c, tag);
+
+	/*
+	 * The reader can only move data to the address space of its own process,
+	 * Rread data for someone else's is left in rx.
+	 */
+	if (r != NULL && r->uio != NULL && O9FS_GBIT8(hd + Offtype) == O9FS_RREAD &&
+	    (r->uio->uio_segflg == UIO_SYSSPACE || r->uio->uio_procp == curproc))
+		return o9fs_recvuio(c, r, hd, len);
+
+	if (r != NULL && len > r->rxsize && len <= fs->sess->msize) {
+		/* Larger than expected, e.g. a long Rstat */
+		o9fs_buffree(fs, r->rx, r->rxsize);
+		r->rx = o9fs_bufalloc(fs, len, &r->rxsize);
+	}
+	if (r == NULL || len > r->rxsize) {
+		DBG("dropping R-message tag %d len %d\n", tag, len);
+		for (len -= Minhd; len > 0; len -= n) {
+			n = MIN(len, sizeof(junk));
+			if ((error = readn(c, junk, n)) != 0)
+				return error;
+		}
+		if (r != NULL) {
+			r->error = EMSGSIZE;
+			r->flags |= O9REQ_DONE;
+			wakeup(r);
+		}
+		return 0;
+	}
+
+	memcpy(r->rx, hd, Minhd);
+	error = readn(c, r->rx + Minhd, len - Minhd);
+	if (error)
+		return error;
+
+	r->flags |= O9REQ_DONE;
+	wakeup(r);
+	return 0;
+}
+
+/*
+ * Send requests batched by o9fs_rpcv in a single write.
+ */
+static int
+o9fs_sendv(struct o9conn *c, struct o9req **r, int n)
+{
+	struct file *fp;
+	struct uio auio;
+	struct iovec aiov[Nbatch];
+	long len;
+	int error, i;
+
+	fp = c->fp;
+	len = 0;
+	for (i = 0; i < n; i++) {
+		aiov[i].iov_base = r[i]->tx;
+		aiov[i].iov_len = O9FS_GBIT32(r[i]->tx);
+		len += aiov[i].iov_len;
+	}
+	auio.uio_iov = aiov;
+	auio.uio_iovcnt = n;
+	auio.uio_resid = len;
+	auio.uio_segflg = UIO_SYSSPACE;
+	auio.uio_rw = UIO_WRITE;
+	auio.uio_procp = curproc;
+
+	error = (*fp->f_ops->fo_write)(fp, &fp->f_offset, &auio, fp->f_cred);
+	fp->f_wxfer++;
+	fp->f_wbytes += len - auio.uio_resid;
+	if (error == 0 && auio.uio_resid != 0)
+		error = EIO;
+	return error;
+}
+
+/*
+ * Tag the n requests in r and send them, all on the same connection.
+ * A failure to send is reported to each request by o9fs_rpcwait.
+ */
+static int
+o9fs_rpcsend(struct o9fs *fs, struct o9req **r, int n)
+{
+	struct o9conn *c;
+	struct mbuf *top;
+	long len;
+	int error, i;
+
+	if (n > Nbatch)
+		panic("o9fs_rpcsend: %d requests in a batch", n);
+	c = r[0]->conn;
+	for (i = 1; i < n; i++)
+		if (r[i]->conn != c)
+			panic("o9fs_rpcsend: batch over several connections");
+
+	for (i = 0; i < n; i++) {
+		r[i]->flags = 0;
+		r[i]->error = 0;
+	}
+
+	/* Only the process bringing the connection back may use it meanwhile */
+	error = EIO;
+	if ((c->flags & O9FS_DEAD) || (c->redial != NULL && c->redial != curproc))
+		goto lost;
+
+	for (i = 0; i < n; i++) {
+		if (O9FS_GBIT8(r[i]->tx + Offtype) == O9FS_TVERSION)
+			r[i]->tag = O9FS_NOTAG;
+		else if ((error = o9fs_tagalloc(c, r[i])) != 0) {
+			while (--i >= 0)
+				o9fs_tagfree(c, r[i]);
+			goto lost;
+		}
+		O9FS_PBIT16(r[i]->tx + Offtag, r[i]->tag);
+	}
+
+	top = NULL;
+	if (n == 1 && O9FS_GBIT8(r[0]->tx + Offtype) == O9FS_TWRITE &&
+	    c->fp->f_type == DTYPE_SOCKET && c->ring == NULL) {
+		len = Minhd + 4 + 8 + 4;
+		top = o9fs_mwrite(r[0], len, O9FS_GBIT32(r[0]->tx) - len, &error);
+		if (top == NULL) {
+			o9fs_tagfree(c, r[0]);
+			return error;
+		}
+	}
+
+	if ((error = o9fs_schedin(fs, r, n)) != 0) {
+		if (top != NULL)
+			m_freem(top);
+		for (i = 0; i < n; i++)
+			o9fs_tagfree(c, r[i]);
+		goto lost;
+	}
+
+	for (i = 0; i < n; i++)
+		TAILQ_INSERT_TAIL(&c->reqq, r[i], next);
+
+	if (c->ring != NULL)
+		error = o9fs_ringsend(fs, c, r, n);
+	else if (n == 1)
+		error = o9fs_send(c, r[0], top);
+	else
+		error = o9fs_sendv(c, r, n);
+	o9fs_sndunlock(c);
+	if (error)
+		o9fs_rpcabort(fs, c, error);
+	return 0;
+
+lost:
+	if (!(c->flags & O9FS_DEAD) && (c->redial == NULL || c->redial == curproc))
+		return error;
+	for (i = 0; i < n; i++)
+		r[i]->flags |= O9REQ_LOST;
+	return EIO;
+}
+
+/*
+ * Wait for r to be done or for timo ticks, reading replies if nobody
+ * else is. A signal makes it return EINTR if catch is set.
+ */
+static int
+o9fs_rpcstep(struct o9fs *fs, struct o9req *r, int timo, int catch)
+{
+	struct o9conn *c;
+	int error;
+
+	c = r->conn;
+	if (c->flags & O9FS_RCVLOCK) {
+		error = tsleep(r, PRIBIO | catch, "o9fsrep", timo);
+		return error == ERESTART ? EINTR : error;
+	}
+
+	c->flags |= O9FS_RCVLOCK;
+	error = o9fs_recv(fs, c);
+	c->flags &= ~O9FS_RCVLOCK;
+	if (error == EWOULDBLOCK || error == EINTR) {
+		if (catch && CURSIG(curproc))
+			return EINTR;
+		if (error == EINTR)
+			rdretry(c, error);
+		return 0;
+	}
+	if (error)
+		o9fs_rpcabort(fs, c, error);
+	return 0;
+}
+
+/*
+ * Give up on r. The server is told with a Tflush, and once the Rflush
+ * is in r will get no reply and its tag can be used again.
+ */
+static void
+o9fs_flush(struct o9fs *fs, struct o9req *r, int error)
+{
+	struct o9req *f;
+
+	DBG("flushing tag %d\n", r->tag);
+	r->flags |= O9REQ_FLUSH;
+	f = o9fs_rpcalloc(fs, Minhd + 2, Minhd);
+	f->conn = r->conn;
+	O9FS_PBIT32(f->tx, Minhd + 2);
+	O9FS_PBIT8(f->tx + Offtype, O9FS_TFLUSH);
+	O9FS_PBIT16(f->tx + Minhd, r->tag);
+	o9fs_rpc(fs, f);
+	o9fs_rpcfree(fs, f);
+
+	/* The reply may have made it before the Rflush */
+	if (!(r->flags & O9REQ_DONE)) {
+		r->error = error;
+		r->flags |= O9REQ_DONE;
+	}
+}
+
+/* Errors for the strings of Rerror, as Plan 9 and the usual servers word them */
+static struct {
+	char	*s;
+	int		error;
+} rerrtab[] = {
+	{ "permission denied", EACCES },
+	{ "Permission denied", EACCES },
+	{ "does not exist", ENOENT },
+	{ "not found", ENOENT },
+	{ "No such file", ENOENT },
+	{ "exists", EEXIST },
+	{ "not a directory", ENOTDIR },
+	{ "Not a directory", ENOTDIR },
+	{ "is a directory", EISDIR },
+	{ "Is a directory", EISDIR },
+	{ "not empty", ENOTEMPTY },
+	{ "in use", EBUSY },
+	{ "read only", EROFS },
+	{ "Read-only", EROFS },
+};
+
+/*
+ * The error for the string of an Rerror, s of n bytes, EIO if unknown.
+ */
+static int
+rerrno(u_char *s, int n)
+{
+	int i, j, len;
+
+	for (i = 0; i < sizeof(rerrtab) / sizeof(rerrtab[0]); i++) {
+		len = strlen(rerrtab[i].s);
+		for (j = 0; j + len <= n; j++)
+			if (memcmp(s + j, rerrtab[i].s, len) == 0)
+				return rerrtab[i].error;
+	}
+	return EIO;
+}
+
+/*
+ * Wait for the reply to r, reading from the server if nobody else is.
+ * Returns the size of the R-message, or <= 0 on error, also left in r->error.
+ * A Tflush cannot be interrupted; if it times out the server is deemed gone.
+ */
+static long
+o9fs_rpcwait(struct o9fs *fs, struct o9req *r)
+{
+	struct o9conn *c;
+	struct o9req *nr;
+	int catch, deadline, error, timo;
+	uint8_t type;
+
+	c = r->conn;
+	type = O9FS_GBIT8(r->tx + Offtype);
+	catch = type == O9FS_TFLUSH ? 0 : PCATCH;
+	deadline = ticks + fs->sess->timeout;
+	while (!(r->flags & O9REQ_DONE)) {
+		timo = 0;
+		if (fs->sess->timeout != 0 && (timo = deadline - ticks) <= 0)
+			error = ETIMEDOUT;
+		else
+			error = o9fs_rpcstep(fs, r, timo, catch);
+		if (error == 0 || error == EWOULDBLOCK)
+			continue;
+		if (catch)
+			o9fs_flush(fs, r, error);
+		else
+			o9fs_rpcabort(fs, c, error);
+	}
+
+	TAILQ_REMOVE(&c->reqq, r, next);
+	o9fs_tagfree(c, r);
+
+	/* Bulk data out of the way may let the next bulk request go */
+	if (r->bulk) {
+		c->bulk -= r->bulk;
+		o9fs_schedkick(c);
+	}
+
+	/* Pass the reader role on, abandoned requests wait on their Tflush */
+	if (!(c->flags & O9FS_RCVLOCK))
+		TAILQ_FOREACH(nr, &c->reqq, next)
+			if (!(nr->flags & O9REQ_FLUSH)) {
+				wakeup(nr);
+				break;
+			}
+
+	if (r->error)
+		return -r->error;
+
+	if (O9FS_GBIT8(r->rx + Offtype) == O9FS_RERROR) {
+		if (verbose)
+			printf("%.*s\n", O9FS_GBIT16(r->rx + Minhd), r->rx + Minhd + 2);
+		r->error = rerrno(r->rx + Minhd + 2,
+		    MIN(O9FS_GBIT16(r->rx + Minhd), O9FS_GBIT32(r->rx) - (Minhd + 2)));
+		return -1;
+	}
+	if (O9FS_GBIT8(r->rx + Offtype) != type + 1) {
+		printf("o9fs_rpc: R-message type %d for T-message type %d\n",
+		    O9FS_GBIT8(r->rx + Offtype), type);
+		r->error = EIO;
+		return -1;
+	}
+
+	return O9FS_GBIT32(r->rx);
+}
+
+/*
+ * Set up the connection to the server for o9fs_rpc.
+ * Socket waits are made uninterruptible, so that a signal cannot cut
+ * a message in half, and o9fs_rpcstep does the interrupting instead.
+ */
+void
+o9fs_rpcinit(struct o9fs *fs, struct o9conn *c)
+{
+	struct socket *so;
+
+	if (c->fp->f_type != DTYPE_SOCKET)
+		return;
+	so = (struct socket *)c->fp->f_data;
+	so->so_rcv.sb_flags |= SB_NOINTR;
+	so->so_rcv.sb_timeo = Rdpoll;
+	so->so_snd.sb_flags |= SB_NOINTR;
+	so->so_snd.sb_timeo = fs->sess->timeout;
+}
+
+/*
+ * Put fp in the place of the lost connection c once nobody uses it.
+ * Until o9fs_rpcresume only the calling process can send on it,
+ * everybody else waits in o9fs_retry.
+ */
+void
+o9fs_rpcreset(struct o9fs *fs, struct o9conn *c, struct file *fp)
+{
+	while (!TAILQ_EMPTY(&c->reqq) || !TAILQ_EMPTY(&c->sndq[Smeta]) ||
+	    !TAILQ_EMPTY(&c->sndq[Sbulk]) || (c->flags & (O9FS_SNDLOCK | O9FS_RCVLOCK)))
+		tsleep(&c->reqq, PRIBIO, "o9fsdrain", hz / 10);
+
+	/* Whatever the server does now, it starts over on the new socket */
+	o9fs_ringdetach(c);
+	FRELE(c->fp);
+	c->fp = fp;
+	c->flags = 0;
+	c->nexttag = 0;
+	c->bulk = 0;
+	c->redial = curproc;
+	o9fs_rpcinit(fs, c);
+}
+
+/*
+ * Done bringing c back. On success the requests lost with the old
+ * connection go again, otherwise they keep waiting for the next try.
+ */
+void
+o9fs_rpcresume(struct o9conn *c, int error)
+{
+	c->redial = NULL;
+	if (error) {
+		c->flags |= O9FS_DEAD;
+		return;
+	}
+	c->gen++;
+	wakeup(&c->gen);
+}
+
+/*
+ * The n requests in r failed. If they were lost with their connection
+ * and the mount reconnects, wait for it to come back and say whether
+ * to send them again. Requests the server may have carried out already
+ * are not sent again, nor those of the session setup.
+ */
+static int
+o9fs_retry(struct o9fs *fs, struct o9req **r, int n, int gen)
+{
+	struct o9conn *c;
+	int deadline, error, i, lost, timo;
+
+	c = r[0]->conn;
+	if (!fs->sess->reconnect || c->redial == curproc)
+		return 0;
+
+	lost = 0;
+	for (i = 0; i < n; i++) {
+		switch (O9FS_GBIT8(r[i]->tx + Offtype)) {
+		case O9FS_TVERSION:
+		case O9FS_TAUTH:
+		case O9FS_TATTACH:
+		case O9FS_TFLUSH:
+		case O9FS_TCREATE:
+		case O9FS_TREMOVE:
+			return 0;
+		}
+		if (r[i]->flags & O9REQ_LOST)
+			lost = 1;
+	}
+	if (!lost)
+		return 0;
+
+	deadline = ticks + fs->sess->timeout;
+	while (c->gen == gen) {
+		timo = 0;
+		if (fs->sess->timeout != 0 && (timo = deadline - ticks) <= 0)
+			error = ETIMEDOUT;
+		else
+			error = tsleep(&c->gen, PRIBIO | PCATCH, "o9fsdial", timo);
+		if (error == 0 || error == EWOULDBLOCK)
+			continue;
+		for (i = 0; i < n; i++)
+			r[i]->error = error == ETIMEDOUT ? ETIMEDOUT : EINTR;
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Send the T-message in r->tx and wait for its reply in r->rx.
+ * Returns the size of the R-message, or <= 0 on error.
+ */
+long
+o9fs_rpc(struct o9fs *fs, struct o9req *r)
+{
+	struct uio uio;
+	struct iovec iov[UIO_SMALLIOV];
+	long n;
+	int error, gen, retry;
+
+	/* Keep where the data was, to go again after a reconnect */
+	retry = 1;
+	if (r->uio != NULL) {
+		if (r->uio->uio_iovcnt > UIO_SMALLIOV)
+			retry = 0;
+		else {
+			uio = *r->uio;
+			bcopy(uio.uio_iov, iov, uio.uio_iovcnt * sizeof(struct iovec));
+		}
+	}
+
+	for (;;) {
+		gen = r->conn->gen;
+		if ((error = o9fs_rpcsend(fs, &r, 1)) != 0) {
+			r->error = error;
+			n = -error;
+		} else
+			n = o9fs_rpcwait(fs, r);
+		if (n > 0 || !retry || !o9fs_retry(fs, &r, 1, gen))
+			return n;
+		if (r->uio != NULL) {
+			*r->uio = uio;
+			bcopy(iov, uio.uio_iov, uio.uio_iovcnt * sizeof(struct iovec));
+		}
+	}
+}
+
+/*
+ * Send the n requests in r in a single write, then wait for all of them.
+ * The server handles them in order, so later requests may use fids
+ * set up by earlier ones. Returns the first error, if any; the outcome
+ * of each request is in its error field.
+ */
+int
+o9fs_rpcv(struct o9fs *fs, struct o9req **r, int n)
+{
+	int error, gen, i;
+
+	do {
+		gen = r[0]->conn->gen;
+		if ((error = o9fs_rpcsend(fs, r, n)) != 0) {
+			for (i = 0; i < n; i++)
+				r[i]->error = error;
+			continue;
+		}
+
+		for (i = 0; i < n; i++)
+			if (o9fs_rpcwait(fs, r[i]) <= 0 && error == 0)
+				error = r[i]->error;
+	} while (error != 0 && o9fs_retry(fs, r, n, gen));
+	return error;
+}
+
+static int
+bclass(struct o9fs *fs, u_long n, u_long *size)
+{
+	if (n <= Smallbuf) {
+		*size = Smallbuf;
+		return Bsmall;
+	}
+	if (n <= Mediumbuf && Mediumbuf < fs->sess->msize) {
+		*size = Mediumbuf;
+		return Bmedium;
+	}
+	*size = fs->sess->msize;
+	return Bmsize;
+}
+
+/*
+ * Get a buffer of at least n bytes, its actual size is put in size.
+ */
+void *
+o9fs_bufalloc(struct o9fs *fs, u_long n, u_long *size)
+{
+	void *p;
+	int c;
+
+	if (n > fs->sess->msize)
+		panic("o9fs_bufalloc: %lu bytes buffer, msize is %ld", n, fs->sess->msize);
+
+	c = bclass(fs, n, size);
+	rw_enter_write(&fs->sess->lock);
+	if ((p = fs->sess->bufs[c].free) != NULL) {
+		fs->sess->bufs[c].free = *(void **)p;
+		fs->sess->bufs[c].nfree--;
+		fs->stats.bufhit[c]++;
+		rw_exit_write(&fs->sess->lock);
+		return p;
+	}
+	fs->stats.bufmiss[c]++;
+	rw_exit_write(&fs->sess->lock);
+	return malloc(*size, M_O9FS, M_WAITOK);
+}
+
+void
+o9fs_buffree(struct o9fs *fs, void *p, u_long size)
+{
+	u_long csize;
+	int c;
+
+	c = bclass(fs, size, &csize);
+
+	/* Buffers from before the msize was negotiated do not fit any class */
+	rw_enter_write(&fs->sess->lock);
+	if (csize != size || fs->sess->bufs[c].nfree >= maxfree[c]) {
+		rw_exit_write(&fs->sess->lock);
+		free(p, M_O9FS);
+		return;
+	}
+	*(void **)p = fs->sess->bufs[c].free;
+	fs->sess->bufs[c].free = p;
+	fs->sess->bufs[c].nfree++;
+	rw_exit_write(&fs->sess->lock);
+}
+
+/*
+ * Requests are recycled through the session's freereq, their buffers
+ * go back to the buffer free lists.
+ * They go on the first connection unless r->conn is changed.
+ */
+struct o9req *
+o9fs_rpcalloc(struct o9fs *fs, u_long txsize, u_long rxsize)
+{
+	struct o9req *r;
+
+	rw_enter_write(&fs->sess->lock);
+	if ((r = TAILQ_FIRST(&fs->sess->freereq)) != NULL)
+		TAILQ_REMOVE(&fs->sess->freereq, r, next);
+	rw_exit_write(&fs->sess->lock);
+	if (r == NULL)
+		r = malloc(sizeof(struct o9req), M_O9FS, M_WAITOK | M_ZERO);
+
+	r->tx = o9fs_bufalloc(fs, txsize, &r->txsize);
+	r->rx = o9fs_bufalloc(fs, rxsize, &r->rxsize);
+	r->uio = NULL;
+	r->conn = fs->sess->conn;
+	r->bulk = 0;
+	return r;
+}
+
+void
+o9fs_rpcfree(struct o9fs *fs, struct o9req *r)
+{
+	if (r == NULL)
+		panic("o9fs_rpcfree: nil request");
+
+	o9fs_buffree(fs, r->tx, r->txsize);
+	o9fs_buffree(fs, r->rx, r->rxsize);
+	r->tx = r->rx = NULL;
+	rw_enter_write(&fs->sess->lock);
+	TAILQ_INSERT_HEAD(&fs->sess->freereq, r, next);
+	rw_exit_write(&fs->sess->lock);
+}
+
+/*
+ * Release the recycled requests and free buffers of a session.
+ */
+void
+o9fs_rpcpurge(struct o9sess *s)
+{
+	struct o9req *r;
+	void *p;
+	int c;
+
+	while ((r = TAILQ_FIRST(&s->freereq)) != NULL) {
+		TAILQ_REMOVE(&s->freereq, r, next);
+		free(r, M_O9FS);
+	}
+
+	for (c = 0; c < Nbclass; c++) {
+		while ((p = s->bufs[c].free) != NULL) {
+			s->bufs[c].free = *(void **)p;
+			free(p, M_O9FS);
+		}
+		s->bufs[c].nfree = 0;
+	}
+}
+
+/*
+ * The socket options mount_o9fs set on the first connection,
+ * as the kernel took them.
+ */
+static void
+sockstats(struct o9conn *c, struct o9fsstats *st)
+{
+	struct socket *so;
+	struct mbuf *m;
+
+	if (c->fp->f_type != DTYPE_SOCKET)
+		return;
+	so = (struct socket *)c->fp->f_data;
+	st->sndbuf = so->so_snd.sb_hiwat;
+	st->rcvbuf = so->so_rcv.sb_hiwat;
+	st->keepalive = (so->so_options & SO_KEEPALIVE) != 0;
+	if (so->so_proto->pr_protocol == IPPROTO_TCP &&
+	    sogetopt(so, IPPROTO_TCP, TCP_NODELAY, &m) == 0) {
+		st->nodelay = *mtod(m, int *) != 0;
+		m_free(m);
+	}
+}
+
+/*
+ * Fill st with the statistics of fs.
+ */
+void
+o9fs_getstats(struct o9fs *fs, struct o9fsstats *st)
+{
+	struct o9kring *rg;
+	u_long size;
+	int c, i;
+
+	*st = fs->stats;
+	strlcpy(st->mntonname, fs->mp->mnt_stat.f_mntonname, MNAMELEN);
+	strlcpy(st->mntfromname, fs->mp->mnt_stat.f_mntfromname, MNAMELEN);
+	st->msize = fs->sess->msize;
+	st->nconn = fs->sess->nconn;
+	st->nshare = fs->sess->ref;
+	st->bulkmax = fs->sess->bulkmax;
+	st->dead = 0;
+	for (i = 0; i < fs->sess->nconn; i++)
+		if (fs->sess->conn[i].flags & O9FS_DEAD)
+			st->dead |= 1 << i;
+	st->nredial = fs->sess->nredial;
+	st->maxfids = fs->maxfids;
+	st->actimeo = fs->actimeo / hz;
+	st->dircache = fs->dircache;
+	st->fidtab = fs->sess->nfids;
+	sockstats(fs->sess->conn, st);
+	if ((rg = fs->sess->conn[0].ring) != NULL) {
+		st->ringslots = rg->nslot;
+		st->ringslotsize = rg->slotsize;
+		st->ringbell = rg->nbell;
+		st->ringsleep = rg->nsleep;
+	}
+	for (c = 0; c < Nbclass; c++) {
+		bclass(fs, c == Bsmall ? 0 : c == Bmedium ? Mediumbuf : fs->sess->msize, &size);
+		st->bufsize[c] = size;
+	}
+}
@@ -9,7 +9,9 @@
 #include <sys/namei.h>
 #include <sys/vnode.h>
 #include <sys/malloc.h>
+#include <sys/pool.h>
 #include <sys/lock.h>
+#include <sys/rwlock.h>
 #include <sys/queue.h>
 
 #include "o9fs.h"
@@ -25,6 +27,8 @@ enum {
 
 uint8_t verbose;
 
+struct pool o9fs_fidpool;
+
 void
 o9fs_dump(u_char *buf, long n)
 {
@@ -43,24 +47,118 @@ o9fs_dump(u_char *buf, long n)
 	printf("\n");
 }
 
-struct o9fid *
-o9fs_getfid(struct o9fs *fs)
+/*
+ * The lowest free fid number of s, the table grows when full.
+ * Called with the session lock held.
+ */
+static int
+fidnum(struct o9sess *s)
+{
+	struct o9fid **fids;
+	uint32_t *map;
+	int i, n;
+
+	for (i = 0; i < s->nfids / 32; i++)
+		if (s->fidmap[i] != ~0U)
+			return i * 32 + ffs(~s->fidmap[i]) - 1;
+
+	n = s->nfids ? 2 * s->nfids : Chunk;
+	fids = malloc(n * sizeof(struct o9fid *), M_O9FS, M_WAITOK | M_ZERO);
+	map = malloc(n / 32 * sizeof(uint32_t), M_O9FS, M_WAITOK | M_ZERO);
+	if (s->nfids > 0) {
+		bcopy(s->fids, fids, s->nfids * sizeof(struct o9fid *));
+		bcopy(s->fidmap, map, s->nfids / 32 * sizeof(uint32_t));
+		free(s->fids, M_O9FS);
+		free(s->fidmap, M_O9FS);
+	}
+	s->fids = fids;
+	s->fidmap = map;
+	i = s->nfids;
+	s->nfids = n;
+	return i;
+}
+
+/*
+ * Clunk the least recently used unopened fids, until a new one fits
+ * in the budget of the mount. They keep their number and vnodes and
+ * are walked to again by o9fs_fiduse. Pinned fids are left alone,
+ * their owner is about to send a request on them, and lazy ones
+ * neither count nor go, the server does not know them.
+ */
+static void
+fidevict(struct o9fs *fs)
 {
 	struct o9fid *f;
+	struct o9req *r;
+	DIN();
 
-	if (TAILQ_EMPTY(&fs->freeq)) {
-		f = (struct o9fid *) malloc(sizeof(struct o9fid), M_O9FS, M_WAITOK);
-		f->fid = fs->nextfid++;
-		TAILQ_INSERT_TAIL(&fs->activeq, f, next);
-	} else {
-		f = TAILQ_FIRST(&fs->freeq);
-		TAILQ_REMOVE(&fs->freeq, f, next);
+	while (fs->maxfids > 0 &&
+	    fs->stats.nfid - fs->stats.nevicted - fs->stats.nlazy >= fs->maxfids) {
+		rw_enter_write(&fs->fidlock);
+		TAILQ_FOREACH(f, &fs->lru, lru)
+			if (f->pin == 0 && !(f->flags & O9FID_LAZY) && !(f->conn->flags & O9FS_DEAD))
+				break;
+		if (f == NULL) {
+			rw_exit_write(&fs->fidlock);
+			break;
+		}
+		TAILQ_REMOVE(&fs->lru, f, lru);
+		f->flags &= ~O9FID_LRU;
+		if (f->path == NULL) {
+			/* Could not be walked to again */
+			rw_exit_write(&fs->fidlock);
+			continue;
+		}
+		f->flags &= ~O9FID_WALKED;
+		f->flags |= O9FID_EVICTED | O9FID_BUSY;
+		fs->stats.nevicted++;
+		fs->stats.fidevict++;
+		rw_exit_write(&fs->fidlock);
+
+		DBG("evicting fid %d\n", f->fid);
+		r = o9fs_tclunkremove(fs, f, O9FS_TCLUNK);
+		o9fs_rpc(fs, r);
+		o9fs_rpcfree(fs, r);
+		f->flags &= ~O9FID_BUSY;
+		wakeup(f);
 	}
+	DRET();
+}
+
+/*
+ * Fids come from a pool and take the lowest free number,
+ * so that the server's fid table stays small.
+ */
+struct o9fid *
+o9fs_getfid(struct o9fs *fs)
+{
+	struct o9sess *s;
+	struct o9fid *f;
+	int n;
+
+	fidevict(fs);
+	s = fs->sess;
+	f = pool_get(&o9fs_fidpool, PR_WAITOK);
+	rw_enter_write(&s->lock);
+	n = fidnum(s);
+	s->fidmap[n / 32] |= 1U << (n % 32);
+	s->fids[n] = f;
+	rw_exit_write(&s->lock);
+	f->fid = n;
+
+	rw_enter_write(&fs->fidlock);
+	TAILQ_INSERT_TAIL(&fs->activeq, f, next);
+	fs->stats.nfid++;
+	fs->stats.fidalloc++;
+	rw_exit_write(&fs->fidlock);
 
 	f->ref = 1;
-	f->parent = NULL;
+	f->pin = 0;
+	f->conn = NULL;
+	f->path = NULL;
 	f->offset = 0;
 	f->mode = -1;
+	f->flags = 0;
 	f->iounit = 0;
 	f->qid.path = 0;
 	f->qid.vers = 0;
@@ -74,8 +172,145 @@ o9fs_putfid(struct o9fs *fs, struct o9fid *f)
 	if (f == NULL)
 		panic("o9fs_putfid: cannot put a nil fid");
 
+	if (f->path != NULL) {
+		free(f->path, M_O9FS);
+		f->path = NULL;
+	}
+	rw_enter_write(&fs->fidlock);
 	TAILQ_REMOVE(&fs->activeq, f, next);
-	TAILQ_INSERT_TAIL(&fs->freeq, f, next);
+	if (f->flags & O9FID_LRU)
+		TAILQ_REMOVE(&fs->lru, f, lru);
+	if (f->flags & O9FID_EVICTED)
+		fs->stats.nevicted--;
+	if (f->flags & O9FID_LAZY)
+		fs->stats.nlazy--;
+	fs->stats.nfid--;
+	rw_exit_write(&fs->fidlock);
+
+	rw_enter_write(&fs->sess->lock);
+	fs->sess->fidmap[f->fid / 32] &= ~(1U << (f->fid % 32));
+	fs->sess->fids[f->fid] = NULL;
+	rw_exit_write(&fs->sess->lock);
+	pool_put(&o9fs_fidpool, f);
+}
+
+/*
+ * Make f a candidate for eviction, at the end of the lru.
+ */
+void
+o9fs_lruadd(struct o9fs *fs, struct o9fid *f)
+{
+	rw_enter_write(&fs->fidlock);
+	if (f->flags & O9FID_LRU)
+		TAILQ_REMOVE(&fs->lru, f, lru);
+	TAILQ_INSERT_TAIL(&fs->lru, f, lru);
+	f->flags |= O9FID_LRU;
+	rw_exit_write(&fs->fidlock);
+}
+
+void
+o9fs_lrudel(struct o9fs *fs, struct o9fid *f)
+{
+	rw_enter_write(&fs->fidlock);
+	if (f->flags & O9FID_LRU)
+		TAILQ_REMOVE(&fs->lru, f, lru);
+	f->flags &= ~O9FID_LRU;
+	rw_exit_write(&fs->fidlock);
+}
+
+/*
+ * Called before a request is sent on f. If f was evicted or
+ * not walked yet it is walked to from the root, otherwise it
+ * becomes the most recently used. Returns -1 if f cannot be used,
+ * else f is pinned against eviction until o9fs_fidrele.
+ */
+int
+o9fs_fiduse(struct o9fs *fs, struct o9fid *f)
+{
+	struct o9req *r;
+	int error;
+
+	while (f->flags & O9FID_BUSY)
+		tsleep(f, PRIBIO, "o9fsfid", 0);
+	rw_enter_write(&fs->fidlock);
+	f->pin++;
+	rw_exit_write(&fs->fidlock);
+	if (!(f->flags & (O9FID_EVICTED | O9FID_LAZY))) {
+		if (f->flags & O9FID_LRU)
+			o9fs_lruadd(fs, f);
+		return 0;
+	}
+
+	f->flags |= O9FID_BUSY;
+	error = o9fs_rewalk(fs, fs->root[f->conn - fs->sess->conn], f);
+	if (error == 0 && (f->flags & O9FID_LAZY)) {
+		rw_enter_write(&fs->fidlock);
+		f->flags &= ~O9FID_LAZY;
+		fs->stats.nlazy--;
+		rw_exit_write(&fs->fidlock);
+	} else if (error == 0) {
+		f->flags &= ~O9FID_EVICTED;
+		rw_enter_write(&fs->fidlock);
+		fs->stats.nevicted--;
+		fs->stats.fidrewalk++;
+		rw_exit_write(&fs->fidlock);
+	} else {
+		if (verbose)
+			printf("o9fs: fid %d to %s lost\n", f->fid, f->path ? f->path : "?");
+		/* Part of the path may have been walked */
+		if (f->flags & O9FID_WALKED) {
+			o9fs_lrudel(fs, f);
+			f->flags &= ~O9FID_WALKED;
+			r = o9fs_tclunkremove(fs, f, O9FS_TCLUNK);
+			o9fs_rpc(fs, r);
+			o9fs_rpcfree(fs, r);
+		}
+		o9fs_fidrele(fs, f);
+	}
+	f->flags &= ~O9FID_BUSY;
+	wakeup(f);
+	return error;
+}
+
+/*
+ * The requests o9fs_fiduse was called for are done.
+ */
+void
+o9fs_fidrele(struct o9fs *fs, struct o9fid *f)
+{
+	rw_enter_write(&fs->fidlock);
+	f->pin--;
+	rw_exit_write(&fs->fidlock);
+}
+
+/*
+ * Mark f, fresh from o9fs_getfid, as not walked yet. The server
+ * does not know it until o9fs_fiduse, so it is out of the budget.
+ */
+void
+o9fs_fidlazy(struct o9fs *fs, struct o9fid *f)
+{
+	rw_enter_write(&fs->fidlock);
+	f->flags |= O9FID_LAZY;
+	fs->stats.nlazy++;
+	rw_exit_write(&fs->fidlock);
+}
+
+/*
+ * The fid of the session numbered fid, or nil.
+ */
+struct o9fid *
+o9fs_fidlookup(struct o9fs *fs, int32_t fid)
+{
+	struct o9fid *f;
+
+	f = NULL;
+	rw_enter_read(&fs->sess->lock);
+	if (fid >= 0 && fid < fs->sess->nfids)
+		f = fs->sess->fids[fid];
+	rw_exit_read(&fs->sess->lock);
+	fs->stats.fidlookup++;
+	return f;
 }
 
 char *
@@ -108,10 +343,14 @@ o9fs_getstr(char *buf)
 	return s;
 }	
 
+/*
+ * The vnode comes back unlocked.
+ */
 int
 o9fs_allocvp(struct mount *mp, struct o9fid *f, struct vnode **vpp, u_long flag)
 {
 	struct vnode *vp;
+	struct o9node *np;
 	int error;
 	DIN();
 
@@ -129,13 +368,238 @@ o9fs_allocvp(struct mount *mp, struct o9fid *f, struct vnode **vpp, u_long flag)
 	else
 		vp->v_type = VREG;
 
-	vp->v_data = f;
+	np = malloc(sizeof(struct o9node), M_O9FS, M_WAITOK | M_ZERO);
+	lockinit(&np->lock, PINOD, "o9fsnode", 0, 0);
+	np->fid = f;
+	np->vp = vp;
+	vp->v_data = np;
 	vp->v_flag = flag;
 	printvp(vp);
 	DRET();
 	return 0;
 }
 
+static struct o9node *
+nodefind(struct o9fs *fs, uint64_t path)
+{
+	struct o9node *np;
+
+	LIST_FOREACH(np, &fs->nodehash[path & fs->nodehashmask], hash)
+		if (np->fid->qid.path == path)
+			return np;
+	return NULL;
+}
+
+/*
+ * The vnode of the file of f, from the hash of fs or a new one.
+ * F becomes the fid of a new vnode, otherwise it is clunked.
+ * The vnode comes back locked.
+ */
+int
+o9fs_nodeget(struct o9fs *fs, struct o9fid *f, struct vnode **vpp, u_long flag)
+{
+	struct o9node *np;
+	struct vnode *vp;
+	uint64_t path;
+	int error;
+
+	path = f->qid.path;
+	for (;;) {
+		if ((np = nodefind(fs, path)) != NULL) {
+			/* It may be reclaimed while vget sleeps */
+			if (vget(np->vp, LK_EXCLUSIVE, curproc) != 0)
+				continue;
+			o9fs_attrcheck(np, &f->qid);
+			o9fs_clunkdefer(fs, f);
+			*vpp = np->vp;
+			return 0;
+		}
+
+		if ((error = o9fs_allocvp(fs->mp, f, &vp, flag)) != 0) {
+			o9fs_clunkdefer(fs, f);
+			*vpp = NULL;
+			return error;
+		}
+
+		if (nodefind(fs, path) == NULL)
+			break;
+
+		/* Somebody got there while getnewvnode slept, ours goes without f */
+		VTON(vp)->fid = NULL;
+		vrele(vp);
+	}
+
+	np = VTON(vp);
+	np->flags |= O9NODE_HASHED;
+	LIST_INSERT_HEAD(&fs->nodehash[path & fs->nodehashmask], np, hash);
+	vn_lock(vp, LK_EXCLUSIVE | LK_RETRY, curproc);
+	*vpp = vp;
+	return 0;
+}
+
+/*
+ * Drop the cached stat of np if qid, from a reply about
+ * its file, shows that the file changed since. A directory
+ * that changed also loses the names cached in it.
+ */
+void
+o9fs_attrcheck(struct o9node *np, struct o9qid *qid)
+{
+	if ((np->flags & O9NODE_ATTR) && np->attr.qid.vers != qid->vers)
+		np->flags &= ~O9NODE_ATTR;
+	if (np->vp->v_type == VDIR && np->fid->qid.vers != qid->vers) {
+		cache_purge(np->vp);
+		o9fs_dirpurge(VFSTOO9FS(np->vp->v_mount), np);
+		np->fid->qid.vers = qid->vers;
+	}
+}
+
+/*
+ * Take the vnode of np out of the hash, e.g. once its file is removed.
+ */
+void
+o9fs_nodeunhash(struct o9node *np)
+{
+	if (np->flags & O9NODE_HASHED) {
+		LIST_REMOVE(np, hash);
+		np->flags &= ~O9NODE_HASHED;
+	}
+}
+
+/*
+ * The vnode numbered ino, if it is in the hash of fs.
+ * Its bucket is that of the qid.path it was numbered after.
+ */
+int
+o9fs_vget(struct mount *mp, ino_t ino, struct vnode **vpp)
+{
+	struct o9fs *fs;
+	struct o9node *np;
+
+	fs = VFSTOO9FS(mp);
+	for (;;) {
+		LIST_FOREACH(np, &fs->nodehash[ino & fs->nodehashmask], hash)
+			if ((ino_t)np->fid->qid.path == ino)
+				break;
+		if (np == NULL) {
+			*vpp = NULL;
+			return ENOENT;
+		}
+		if (vget(np->vp, LK_EXCLUSIVE, curproc) == 0)
+			break;
+	}
+	*vpp = np->vp;
+	return 0;
+}
+
+static u_int
+namehash(char *s, size_t n)
+{
+	u_int h;
+
+	h = 0;
+	while (n-- > 0)
+		h = h*31 + (u_char)*s++;
+	return h;
+}
+
+/*
+ * Drop the listing of np, if any.
+ */
+void
+o9fs_dirpurge(struct o9fs *fs, struct o9node *np)
+{
+	struct o9dir *d;
+
+	if ((d = np->dir) == NULL)
+		return;
+	TAILQ_REMOVE(&fs->dirlru, d, lru);
+	fs->stats.dirmem -= d->size;
+	fs->stats.ndir--;
+	np->dir = NULL;
+	free(d, M_O9FS);
+}
+
+/*
+ * Keep the names of the n entries in stat, the whole directory np,
+ * dropping the least recently used listings to stay under fs->dircache.
+ */
+void
+o9fs_dirsave(struct o9fs *fs, struct o9node *np, struct o9stat *stat, int n)
+{
+	struct o9dir *d;
+	size_t len, size;
+	u_int i, h, nh;
+	char *p;
+	int j;
+
+	o9fs_dirpurge(fs, np);
+	len = 0;
+	for (j = 0; j < n; j++)
+		len += strlen(stat[j].name) + 1;
+	for (nh = 16; nh < 2*n; nh <<= 1)
+		;
+	size = sizeof(*d) + nh * sizeof(uint32_t) + len;
+	if (size > fs->dircache)
+		return;
+	while (fs->stats.dirmem + size > fs->dircache) {
+		d = TAILQ_FIRST(&fs->dirlru);
+		o9fs_dirpurge(fs, d->np);
+		fs->stats.direvict++;
+	}
+
+	d = malloc(size, M_O9FS, M_WAITOK | M_ZERO);
+	d->np = np;
+	d->vers = np->fid->qid.vers;
+	d->time = ticks;
+	d->size = size;
+	d->mask = nh - 1;
+	d->hash = (uint32_t *)(d + 1);
+	d->names = (char *)(d->hash + nh);
+	p = d->names;
+	for (j = 0; j < n; j++) {
+		len = strlen(stat[j].name);
+		h = namehash(stat[j].name, len);
+		for (i = h & d->mask; d->hash[i] != 0; i = (i+1) & d->mask)
+			;
+		d->hash[i] = p - d->names + 1;
+		memcpy(p, stat[j].name, len + 1);
+		p += len + 1;
+	}
+	np->dir = d;
+	TAILQ_INSERT_TAIL(&fs->dirlru, d, lru);
+	fs->stats.dirmem += size;
+	fs->stats.ndir++;
+}
+
+/*
+ * Whether the listing of np says it has no entry name, of length n.
+ * Listings last as long as cached attributes, and until np changes.
+ */
+int
+o9fs_dirabsent(struct o9fs *fs, struct o9node *np, char *name, size_t n)
+{
+	struct o9dir *d;
+	u_int i;
+	char *s;
+
+	if ((d = np->dir) == NULL)
+		return 0;
+	if (d->vers != np->fid->qid.vers || ticks - d->time >= fs->actimeo) {
+		o9fs_dirpurge(fs, np);
+		return 0;
+	}
+	TAILQ_REMOVE(&fs->dirlru, d, lru);
+	TAILQ_INSERT_TAIL(&fs->dirlru, d, lru);
+	for (i = namehash(name, n) & d->mask; d->hash[i] != 0; i = (i+1) & d->mask) {
+		s = d->names + d->hash[i] - 1;
+		if (strncmp(s, name, n) == 0 && s[n] == '\0')
+			return 0;
+	}
+	fs->stats.dirhit++;
+	return 1;
+}
+
 int
 o9fs_permtou(int mode)
 {
@@ -192,9 +656,10 @@ o9fsrealloc(void *ptr, size_t oldsize, size_t newsize)
 	if (newsize == oldsize)
 		return ptr;
 	p = malloc(newsize, M_O9FS, M_WAITOK);
-	if (ptr)
-		bcopy(ptr, p, oldsize);
-	ptr = p;
+	if (ptr) {
+		bcopy(ptr, p, MIN(oldsize, newsize));
+		free(ptr, M_O9FS);
+	}
 	return p;
 }
 
@@ -203,95 +668,17 @@ _printvp(struct vnode *vp)
 {
 	struct o9fid *f;
 
-	f = VTO9(vp);
-	if (vp == NULL || f == NULL) {
-		printf("vp %p fid %p\n",  vp, f);
+	if (vp == NULL || VTON(vp) == NULL || (f = VTO9(vp)) == NULL) {
+		printf("vp %p\n",  vp);
 		return;
 	}
 	printf("[%p] %p fid %d ref %d qid (%.16llx %lu %d) mode %d iounit %ld\n", vp, f, f->fid, f->ref, f->qid.path, f->qid.vers, f->qid.type, f->mode, f->iounit);
 }
 
-static long
-rdwr(struct o9fs *fs, void *buf, long count, off_t *offset, int write)
-{
-	struct file *fp;
-	struct uio auio;
-	struct iovec aiov;
-	long cnt;
-	int error;
-
-	error = 0;
-	fp = fs->servfp;
-	aiov.iov_base = buf;
-	cnt = aiov.iov_len = auio.uio_resid = count;
-	auio.uio_iov = &aiov;
-	auio.uio_segflg = UIO_SYSSPACE;
-	auio.uio_procp = curproc;
-
-	if (write) {
-		auio.uio_rw = UIO_WRITE;
-		error = (*fp->f_ops->fo_write)(fp, offset, &auio, fp->f_cred);
-		cnt -= auio.uio_resid;
-
-		fp->f_wxfer++;
-		fp->f_wbytes += cnt;
-	} else {
-		auio.uio_rw = UIO_READ;
-		error = (*fp->f_ops->fo_read)(fp, offset, &auio, fp->f_cred);
-		cnt -= auio.uio_resid;
-
-		fp->f_rxfer++;
-		fp->f_rbytes += cnt;
-	}
-	if (error)
-		return -error;
-	return cnt;
-}
-
-long
-o9fs_mio(struct o9fs *fs, u_long len)
-{
-	long n;
-
-	n = rdwr(fs, fs->outbuf, len, &fs->servfp->f_offset, 1);
-	if (n <= 0)
-		return n;
-
-	n = rdwr(fs, fs->inbuf, 4, &fs->servfp->f_offset, 0);
-	if (n <= 0) {
-		printf("o9fs_mio: Error reading message size\n");
-		return n;
-	}
-	
-	len = O9FS_GBIT32(fs->inbuf);
-	if (len <= 4) {
-		printf("R-message with length < 4\n");
-		return -1;
-	}
-
-	n = rdwr(fs, fs->inbuf + Offtype, len - Offtype, &fs->servfp->f_offset, 0);
-	if (n <= 0)
-		return n;
-
-	if (O9FS_GBIT8(fs->inbuf + Offtype) == O9FS_RERROR) {
-		if (verbose)
-			printf("%.*s\n", O9FS_GBIT16(fs->inbuf + Minhd), fs->inbuf + Minhd + 2);
-		return -1;
-	}
-
-	return len;
-}
-
-uint16_t
-o9fs_tag(void)
-{
-	return (uint16_t)arc4random()%0xFFFF;
-}
-
 uint32_t
 o9fs_sanelen(struct o9fs *fs, uint32_t n)
 {
-	if (n > fs->msize - Maxhd)
-		n = fs->msize - Maxhd;
+	if (n > fs->sess->msize - Maxhd)
+		n = fs->sess->msize - Maxhd;
 	return n;
 }
@@ -8,9 +8,12 @@
 #include <sys/namei.h>
 #include <sys/vnode.h>
 #include <sys/malloc.h> 
+#include <sys/pool.h>
 #include <sys/filedesc.h>
 #include <sys/file.h>
+#include <sys/rwlock.h>
 #include <sys/queue.h>
+#include <sys/workq.h>
 
 #include "o9fs.h"
 #include "o9fs_extern.h"
@@ -19,15 +22,16 @@ enum{
 	Debug = 0,
 };
 
-#define o9fs_init ((int (*)(struct vfsconf *))nullop)
 
 int o9fs_mount(struct mount *, const char *, void *, struct nameidata *, struct proc *);
 int o9fs_unmount(struct mount *, int, struct proc *);
 int o9fs_statfs(struct mount *, struct statfs *, struct proc *);
 int o9fs_start(struct mount *, int, struct proc *);
 int o9fs_root(struct mount *, struct vnode **);
-static int	mounto9fs(struct mount *, struct file *);
-struct o9fid *o9fs_attach(struct o9fs *, struct o9fid *, char *, char *);
+int o9fs_sysctl(int *, u_int, void *, size_t *, void *, size_t, struct proc *);
+int o9fs_init(struct vfsconf *);
+static int	mounto9fs(struct mount *, struct file **, struct file *, struct o9fs_args *, char *, char *);
+struct o9fid *o9fs_attach(struct o9fs *, struct o9conn *, struct o9fid *, char *, char *);
 
 /*
  * TODO: Check if we are are not overflowing our i/o buffers.
@@ -36,34 +40,41 @@ struct o9fid *o9fs_attach(struct o9fs *, struct o9fid *, char *, char *);
 		
 	
 static uint32_t
-o9fs_version(struct o9fs *fs, uint32_t msize)
+o9fs_version(struct o9fs *fs, struct o9conn *c, uint32_t msize)
 {
 	long n;
 	u_char *p;
+	struct o9req *r;
 
 	if (fs == NULL)
 		return 0;
 
-	p = fs->outbuf;
+	r = o9fs_rpcalloc(fs, 19, Minhd + 4 + 2 + 6);
+	r->conn = c;
+	p = r->tx;
 
 	O9FS_PBIT32(p, 19);
 	O9FS_PBIT8(p + Offtype, O9FS_TVERSION);
-	O9FS_PBIT16(p + Offtag, O9FS_NOTAG);
 	O9FS_PBIT32(p + Minhd, msize);
 	o9fs_putstr(p + Minhd + 4, "9P2000");
 
-	n = o9fs_mio(fs, 19);
-	if (n <= 0)
+	n = o9fs_rpc(fs, r);
+	if (n <= 0) {
+		o9fs_rpcfree(fs, r);
 		return 0;
-	return O9FS_GBIT16(fs->inbuf + Minhd);
+	}
+	n = O9FS_GBIT32(r->rx + Minhd);
+	o9fs_rpcfree(fs, r);
+	return n;
 }	
 
 struct o9fid *
-o9fs_auth(struct o9fs *fs, char *user, char *aname)
+o9fs_auth(struct o9fs *fs, struct o9conn *c, char *user, char *aname)
 {
 	long n;
 	u_char *p;
 	struct o9fid *f;
+	struct o9req *r;
 
 	if (fs == NULL)
 		return NULL;
@@ -71,18 +82,21 @@ o9fs_auth(struct o9fs *fs, char *user, char *aname)
 	user = user ? user : "";
 	aname = aname ? aname : "";
 
-	p = fs->outbuf;
+	r = o9fs_rpcalloc(fs, Minhd + 4 + 2 + strlen(user) + 2 + strlen(aname), Minhd + O9FS_QIDSZ);
+	r->conn = c;
+	p = r->tx;
 	O9FS_PBIT8(p + Offtype, O9FS_TAUTH);
-	O9FS_PBIT16(p + Offtag, o9fs_tag());
 
 	f = o9fs_getfid(fs);
+	f->conn = c;
 	O9FS_PBIT32(p + Minhd, f->fid);
 	p = o9fs_putstr(p + Minhd + 4, user);
 	p = o9fs_putstr(p, aname);
-	n = p - fs->outbuf;
-	O9FS_PBIT32(fs->outbuf, n);
+	n = p - r->tx;
+	O9FS_PBIT32(r->tx, n);
 
-	n = o9fs_mio(fs, n);
+	n = o9fs_rpc(fs, r);
+	o9fs_rpcfree(fs, r);
 	if (n <= 0) {
 		o9fs_putfid(fs, f);
 		return NULL;
@@ -90,132 +104,451 @@ o9fs_auth(struct o9fs *fs, char *user, char *aname)
 	return f;
 }
 
-struct o9fid *
-o9fs_attach(struct o9fs *fs, struct o9fid *afid, char *user, char *aname)
+/*
+ * Attach fid f on c, to the root of aname.
+ */
+static int
+o9fs_tattach(struct o9fs *fs, struct o9conn *c, struct o9fid *f, struct o9fid *afid, char *user, char *aname)
 {
 	long n;
 	u_char *p;
-	struct o9fid *f;
-
-	if (fs == NULL)
-		return NULL;
+	struct o9req *r;
 
 	user = user ? user : "";
 	aname = aname ? aname : "";
 	
-	p = fs->outbuf;
+	r = o9fs_rpcalloc(fs, Minhd + 4 + 4 + 2 + strlen(user) + 2 + strlen(aname), Minhd + O9FS_QIDSZ);
+	r->conn = c;
+	p = r->tx;
 	O9FS_PBIT8(p + Offtype, O9FS_TATTACH);
-	O9FS_PBIT16(p + Offtag, o9fs_tag());
 	
-	f = o9fs_getfid(fs);
+	f->conn = c;
 	O9FS_PBIT32(p + Minhd, f->fid);
 	O9FS_PBIT32(p + Minhd + 4, afid ? afid->fid : -1);
 	p = o9fs_putstr(p + Minhd + 4 + 4, user);
 	p = o9fs_putstr(p, aname);
 	
-	n = p - fs->outbuf;
-	O9FS_PBIT32(fs->outbuf, n);
-	n = o9fs_mio(fs, n);
+	n = p - r->tx;
+	O9FS_PBIT32(r->tx, n);
+	n = o9fs_rpc(fs, r);
 	if (n <= 0) {
+		o9fs_rpcfree(fs, r);
+		return -1;
+	}
+
+	f->qid.type = O9FS_GBIT8(r->rx + Minhd);
+	f->qid.vers = O9FS_GBIT32(r->rx + Minhd + 1);
+	f->qid.path = O9FS_GBIT64(r->rx + Minhd + 1 + 4);
+	f->flags |= O9FID_WALKED;
+	o9fs_rpcfree(fs, r);
+	return 0;
+}
+
+struct o9fid *
+o9fs_attach(struct o9fs *fs, struct o9conn *c, struct o9fid *afid, char *user, char *aname)
+{
+	struct o9fid *f;
+
+	if (fs == NULL)
+		return NULL;
+
+	f = o9fs_getfid(fs);
+	if (o9fs_tattach(fs, c, f, afid, user, aname) < 0) {
 		o9fs_putfid(fs, f);
 		return NULL;
 	}
-
-	f->qid.type = O9FS_GBIT8(fs->inbuf + Minhd);
-	f->qid.vers = O9FS_GBIT32(fs->inbuf + Minhd + 1);
-	f->qid.path = O9FS_GBIT64(fs->inbuf + Minhd + 1 + 4);
+	f->path = o9fs_joinpath("", NULL);
 	return f;
 }
 
+/*
+ * Done with afid once the attach went through it, or failed.
+ */
+static void
+o9fs_authput(struct o9fs *fs, struct o9fid *afid)
+{
+	if (afid == NULL)
+		return;
+	o9fs_clunkremove(fs, afid, O9FS_TCLUNK);
+	o9fs_putfid(fs, afid);
+}
+
+/* Sessions mounted with -o share, by server name */
+static LIST_HEAD(, o9sess) o9fs_sessions = LIST_HEAD_INITIALIZER(o9fs_sessions);
+
+static struct o9sess *
+o9fs_sessfind(char *name)
+{
+	struct o9sess *s;
+
+	LIST_FOREACH(s, &o9fs_sessions, next)
+		if (strcmp(s->name, name) == 0 && !(s->conn[0].flags & O9FS_DEAD))
+			return s;
+	return NULL;
+}
+
+/*
+ * Negotiate a session over the connections in fp for fs, the first
+ * over the ring in rfp if not nil. Every connection gets its own
+ * version, and msize ends up the smallest granted over all of them.
+ */
+static int
+o9fs_sessnew(struct o9fs *fs, struct file **fp, struct file *rfp, struct o9fs_args *args, char *name)
+{
+	struct o9sess *s;
+	struct o9conn *c;
+	uint32_t msize;
+	int error, i;
+
+	s = malloc(sizeof(struct o9sess), M_O9FS, M_WAITOK | M_ZERO);
+	strlcpy(s->name, name, MNAMELEN);
+	s->ref = 1;
+	s->reconnect = (args->flags & O9FS_MRECONN) != 0;
+	LIST_INIT(&s->mounts);
+	rw_init(&s->lock, "o9fssess");
+	TAILQ_INIT(&s->freereq);
+	s->timeout = args->timeout * hz;
+	s->msize = args->msize ? args->msize : O9FS_MSIZE;
+	s->nconn = args->nconn;
+	s->conn = malloc(s->nconn * sizeof(struct o9conn), M_O9FS, M_WAITOK | M_ZERO);
+	for (i = 0; i < s->nconn; i++) {
+		c = &s->conn[i];
+		c->fp = fp[i];
+		TAILQ_INIT(&c->reqq);
+		TAILQ_INIT(&c->sndq[Smeta]);
+		TAILQ_INIT(&c->sndq[Sbulk]);
+	}
+	fs->sess = s;
+
+	/* A message must fit in a slot */
+	if (rfp != NULL) {
+		if ((error = o9fs_ringattach(&s->conn[0], rfp)) != 0)
+			return error;
+		s->msize = MIN(s->msize, s->conn[0].ring->slotsize);
+	}
+
+	for (i = 0; i < s->nconn; i++) {
+		c = &s->conn[i];
+		o9fs_rpcinit(fs, c);
+		msize = o9fs_version(fs, c, s->msize);
+		if (msize < O9FS_MINMSIZE)
+			return EIO;
+
+		/* The server may only lower our msize, size the buffers to what it granted */
+		if (msize < s->msize) {
+			s->msize = msize;
+			o9fs_rpcpurge(s);
+		}
+	}
+
+	s->bulkmax = args->bulkmax ? args->bulkmax : O9FS_BULKMAX * s->msize;
+
+	if (args->flags & O9FS_MSHARE) {
+		s->share = 1;
+		LIST_INSERT_HEAD(&o9fs_sessions, s, next);
+	}
+	return 0;
+}
+
+/*
+ * Drop a mount's reference to its session, closing it with the last one.
+ */
+static void
+o9fs_sessrele(struct o9sess *s)
+{
+	int i;
+
+	if (--s->ref > 0)
+		return;
+	if (s->share)
+		LIST_REMOVE(s, next);
+	for (i = 0; i < s->nconn; i++) {
+		o9fs_ringdetach(&s->conn[i]);
+		FRELE(s->conn[i].fp);
+	}
+	o9fs_rpcpurge(s);
+	if (s->nfids > 0) {
+		free(s->fids, M_O9FS);
+		free(s->fidmap, M_O9FS);
+	}
+	free(s->conn, M_O9FS);
+	free(s, M_O9FS);
+}
+
+/*
+ * Attach to aname on every connection of the session, either
+ * a shared one for the server or a new one over the files in fp
+ * and the ring in rfp.
+ */
 int
-mounto9fs(struct mount *mp, struct file *fp)
+mounto9fs(struct mount *mp, struct file **fp, struct file *rfp, struct o9fs_args *args, char *name, char *aname)
 {
 	struct o9fs *fs;
-	struct vnode *rvp;
-	struct o9fid *fid;
-	uint32_t msize;
+	struct o9sess *s;
+	struct o9conn *c;
+	struct o9fid *afid;
+	int error, i;
 
 	fs = (struct o9fs *) malloc(sizeof(struct o9fs), M_MISCFSMNT, M_WAITOK | M_ZERO);
 	fs->mp = mp;
-	fs->servfp = fp;
+	rw_init(&fs->fidlock, "o9fsfid");
+	TAILQ_INIT(&fs->activeq);
+	TAILQ_INIT(&fs->lru);
+	TAILQ_INIT(&fs->clunkq);
+	fs->maxfids = args->maxfids;
+	fs->actimeo = args->actimeo * hz;
+	fs->dircache = args->dircache;
+	TAILQ_INIT(&fs->dirlru);
+
+	s = NULL;
+	if (args->flags & O9FS_MSHARE)
+		s = o9fs_sessfind(name);
+	if (s != NULL) {
+		s->ref++;
+		fs->sess = s;
+		for (i = 0; i < args->nconn; i++)
+			FRELE(fp[i]);
+		if (rfp != NULL)
+			FRELE(rfp);
+	} else if (args->nconn == 0) {
+		if (rfp != NULL)
+			FRELE(rfp);
+		free(fs, M_MISCFSMNT);
+		return ENOENT;
+	} else if ((error = o9fs_sessnew(fs, fp, rfp, args, name)) != 0) {
+		o9fs_sessrele(fs->sess);
+		free(fs, M_MISCFSMNT);
+		return error;
+	}
+	s = fs->sess;
+
+	for (i = 0; i < s->nconn; i++) {
+		c = &s->conn[i];
+		afid = o9fs_auth(fs, c, "none", aname);
+		fs->root[i] = o9fs_attach(fs, c, afid, "iru", aname);
+		o9fs_authput(fs, afid);
+		if (fs->root[i] == NULL) {
+			while (--i >= 0) {
+				o9fs_clunkremove(fs, fs->root[i], O9FS_TCLUNK);
+				o9fs_putfid(fs, fs->root[i]);
+			}
+			o9fs_sessrele(s);
+			free(fs, M_MISCFSMNT);
+			return EIO;
+		}
+	}
+
+	strlcpy(fs->aname, aname, sizeof(fs->aname));
 	mp->mnt_data = (qaddr_t) fs;
 	vfs_getnewfsid(mp);	
+	fs->nodehash = hashinit(O9FS_NODEHASH, M_O9FS, M_WAITOK, &fs->nodehashmask);
+
+	/* Without clunkwq yet, a failed nodeget clunks the first root before returning */
+	if ((error = o9fs_nodeget(fs, fs->root[0], &fs->vroot, VROOT)) != 0) {
+		for (i = 1; i < s->nconn; i++) {
+			o9fs_clunkremove(fs, fs->root[i], O9FS_TCLUNK);
+			o9fs_putfid(fs, fs->root[i]);
+		}
+		free(fs->nodehash, M_O9FS);
+		mp->mnt_data = NULL;
+		o9fs_sessrele(s);
+		free(fs, M_MISCFSMNT);
+		return error;
+	}
+	VOP_UNLOCK(fs->vroot, 0, curproc);
 
-	fs->inbuf = malloc(8192+Maxhd, M_O9FS, M_WAITOK | M_ZERO);
-	fs->outbuf = malloc(8192+Maxhd, M_O9FS, M_WAITOK | M_ZERO);
-	TAILQ_INIT(&fs->activeq);
-	TAILQ_INIT(&fs->freeq);
-	fs->nextfid = 0;	
+	fs->clunkwq = workq_create("o9fsclunk", 1, IPL_NONE);
+	LIST_INSERT_HEAD(&s->mounts, fs, next);
+	return 0;
+}
+	
 
-	msize = o9fs_version(fs, 8192+Maxhd);
-	if (msize < Maxhd)
-		return EIO;
-	fs->msize = msize;
+/*
+ * Bring connection i of the session back over fp, dialed by mount_o9fs
+ * after the old one was lost. Every mount attaches again with its old
+ * root fid and walks the fids the server knew back to their paths with
+ * their old numbers, so vnodes and the requests waiting in o9fs_retry
+ * carry on as if nothing happened.
+ */
+static int
+o9fs_reconnect(struct o9fs *fs, int i, struct file *fp)
+{
+	struct o9sess *s;
+	struct o9conn *c;
+	struct o9fs *m;
+	struct o9fid *f, *afid, **fids;
+	int j, n, nf;
+
+	s = fs->sess;
+	c = &s->conn[i];
+	if (!(c->flags & O9FS_DEAD) || c->redial != NULL) {
+		FRELE(fp);
+		return 0;
+	}
 
-	fid = o9fs_attach(fs, o9fs_auth(fs, "none", ""), "iru", "");
-	if (fid == NULL)
+	o9fs_rpcreset(fs, c, fp);
+
+	/* The buffers are sized for the old msize, the server must grant it again */
+	if (o9fs_version(fs, c, s->msize) != s->msize) {
+		o9fs_rpcresume(c, EIO);
 		return EIO;
+	}
+	LIST_FOREACH(m, &s->mounts, next) {
+		afid = o9fs_auth(m, c, "none", m->aname);
+		n = o9fs_tattach(m, c, m->root[i], afid, "iru", m->aname);
+		o9fs_authput(m, afid);
+		if (n < 0) {
+			o9fs_rpcresume(c, EIO);
+			return EIO;
+		}
+	}
+
+	/*
+	 * The walks take fidlock, so they go over a copy of activeq.
+	 * Nothing else can walk or clunk fids of c meanwhile.
+	 */
+	LIST_FOREACH(m, &s->mounts, next) {
+		for (;;) {
+			nf = m->stats.nfid + 1;
+			fids = malloc(nf * sizeof(struct o9fid *), M_O9FS, M_WAITOK);
+			rw_enter_read(&m->fidlock);
+			if (m->stats.nfid <= nf)
+				break;
+			rw_exit_read(&m->fidlock);
+			free(fids, M_O9FS);
+		}
+		n = 0;
+		TAILQ_FOREACH(f, &m->activeq, next)
+			if (f->conn == c && f != m->root[i] && (f->flags & O9FID_WALKED))
+				fids[n++] = f;
+		rw_exit_read(&m->fidlock);
+
+		for (j = 0; j < n; j++) {
+			f = fids[j];
+			if (o9fs_rewalk(m, m->root[i], f) < 0 && verbose)
+				printf("o9fs: fid %d to %s lost\n", f->fid, f->path ? f->path : "?");
+		}
+		free(fids, M_O9FS);
+	}
 
-	return o9fs_allocvp(fs->mp, fid, &fs->vroot, VROOT);
+	s->nredial++;
+	o9fs_rpcresume(c, 0);
+	printf("o9fs: connection %d to %s restored\n", i, s->name);
+	return 0;
+}
+
+/*
+ * Mount update: new connections to the server for the lost ones,
+ * in the fds of args that are not -1.
+ */
+static int
+o9fs_update(struct mount *mp, struct o9fs_args *args, struct proc *p)
+{
+	struct o9fs *fs;
+	struct file *fp;
+	int error, i;
+
+	fs = VFSTOO9FS(mp);
+	if (args->nconn != fs->sess->nconn)
+		return EINVAL;
+
+	for (i = 0; i < args->nconn; i++) {
+		if (args->fd[i] < 0)
+			continue;
+		if ((fp = fd_getfile(p->p_fd, args->fd[i])) == NULL)
+			return EBADF;
+		FREF(fp);
+		if ((error = o9fs_reconnect(fs, i, fp)) != 0)
+			return error;
+	}
+	return 0;
 }
-	
 
 int
 o9fs_mount(struct mount *mp, const char *path, void *data, struct nameidata *ndp, struct proc *p)
 {
 	struct o9fs_args args;
-	int error;
+	int error, i;
 	size_t len;
-	struct file *fp;
-
-	if (mp->mnt_flag & MNT_UPDATE)
-		return EOPNOTSUPP;
+	struct file *fp[O9FS_MAXCONN], *rfp;
+	char from[MNAMELEN], aname[MNAMELEN];
 
 	error = copyin(data, &args, sizeof(struct o9fs_args));
 	if (error)
 		return error;
 
-	if ((fp = fd_getfile(p->p_fd, args.fd)) == NULL)
-		return EBADF;
-	FREF(fp);
+	if (mp->mnt_flag & MNT_UPDATE)
+		return o9fs_update(mp, &args, p);
+
+	if (args.msize != 0 && (args.msize < O9FS_MINMSIZE || args.msize > O9FS_MAXMSIZE))
+		return EINVAL;
+	if (args.timeout > O9FS_MAXTIMEOUT)
+		return EINVAL;
+	if (args.bulkmax > O9FS_MAXBULK)
+		return EINVAL;
+	if (args.maxfids != 0 && (args.maxfids < O9FS_MINFIDS || args.maxfids > O9FS_MAXFIDS))
+		return EINVAL;
+	if (args.actimeo > O9FS_MAXACTIMEO)
+		return EINVAL;
+	if (args.dircache > O9FS_MAXDIRCACHE)
+		return EINVAL;
+	if (args.nconn < 0 || args.nconn > O9FS_MAXCONN)
+		return EINVAL;
+	if (args.nconn == 0 && !(args.flags & O9FS_MSHARE))
+		return EINVAL;
+	if (args.ringfd >= 0 && args.nconn > 1)
+		return EINVAL;
+
+	if ((error = copyinstr(args.hostname, from, sizeof(from), &len)) != 0)
+		return error;
+	aname[0] = '\0';
+	if (args.aname != NULL &&
+	    (error = copyinstr(args.aname, aname, sizeof(aname), &len)) != 0)
+		return error;
+
+	for (i = 0; i < args.nconn; i++) {
+		if ((fp[i] = fd_getfile(p->p_fd, args.fd[i])) == NULL) {
+			while (--i >= 0)
+				FRELE(fp[i]);
+			return EBADF;
+		}
+		FREF(fp[i]);
+	}
+	rfp = NULL;
+	if (args.ringfd >= 0) {
+		if ((rfp = fd_getfile(p->p_fd, args.ringfd)) == NULL) {
+			for (i = 0; i < args.nconn; i++)
+				FRELE(fp[i]);
+			return EBADF;
+		}
+		FREF(rfp);
+	}
 
 	if (args.verbose)
 		verbose = 1;
 
-	if (mounto9fs(mp, fp) != 0)
-		return EIO;
+	if ((error = mounto9fs(mp, fp, rfp, &args, from, aname)) != 0)
+		return error;
 	printvp(VFSTOO9FS(mp)->vroot);
 
 	bzero(mp->mnt_stat.f_mntonname, MNAMELEN);
 	strlcpy(mp->mnt_stat.f_mntonname, path, MNAMELEN);
 	bzero(mp->mnt_stat.f_mntfromname, MNAMELEN);
-	strlcpy(mp->mnt_stat.f_mntfromname, args.hostname, MNAMELEN);
+	strlcpy(mp->mnt_stat.f_mntfromname, from, MNAMELEN);
 	return 0;
 }
 
 int
 o9fs_root(struct mount *mp, struct vnode **vpp)
 {
-	struct o9fid *f;
 	struct o9fs *fs;
-	int error;
 
 	DIN();
 
 	fs = VFSTOO9FS(mp);
-	f = o9fs_walk(fs, VTO9(fs->vroot), NULL, NULL);
-	if (f == NULL) {
-		DRET();
-		return -1;
-	}
-
-	error = o9fs_allocvp(mp, f, vpp, VROOT);
-	if (error) {
-		DBG("failed to alloc vnode\n");
-		DRET();
-		return error;
-	}
-	vn_lock(*vpp, LK_EXCLUSIVE | LK_RETRY, curproc);
+	vref(fs->vroot);
+	vn_lock(fs->vroot, LK_EXCLUSIVE | LK_RETRY, curproc);
+	*vpp = fs->vroot;
 	DRET();
 	return 0;
 }
@@ -226,28 +559,50 @@ o9fs_unmount(struct mount *mp, int mntflags, struct proc *p)
 	struct o9fs *fs;
 	struct vnode *vp;
 	struct o9fid *f;
-	struct file *fp;
-	int error, flags;
+	int error, flags, i;
 	DIN();
 
 	flags = 0;
 	fs = VFSTOO9FS(mp);
-	fp = fs->servfp;
 	vp = fs->vroot;
 	f = VTO9(vp);
 
 	if (mntflags & MNT_FORCE)
 		flags |= FORCECLOSE;
 
-	error = vflush(mp, NULL, flags);
+	/* The mount holds a reference to the root vnode */
+	error = vflush(mp, vp, flags);
 	if (error) {
 		DBG("error in vflush %d\n", error);
 		DRET();
 		return error;
 	}
-
-	free(fs->inbuf, M_O9FS);
-	free(fs->outbuf, M_O9FS);
+	if (vp->v_usecount > 1 && !(flags & FORCECLOSE)) {
+		DRET();
+		return EBUSY;
+	}
+	vrele(vp);
+	vgone(vp);
+
+	/* The reclaims left clunks in the background */
+	while (fs->clunking)
+		tsleep(&fs->clunkq, PRIBIO, "o9fsclunk", 0);
+	if (fs->clunkwq != NULL)
+		workq_destroy(fs->clunkwq);
+
+	/*
+	 * The root vnode's fid went with it. The fids left, like the
+	 * other roots, go back to the pool; if the session stays the server
+	 * must forget them too, as their numbers will be used again.
+	 */
+	while ((f = TAILQ_FIRST(&fs->activeq)) != NULL) {
+		if (fs->sess->ref > 1 && (f->flags & O9FID_WALKED))
+			o9fs_clunkremove(fs, f, O9FS_TCLUNK);
+		o9fs_putfid(fs, f);
+	}
+	LIST_REMOVE(fs, next);
+	o9fs_sessrele(fs->sess);
+	free(fs->nodehash, M_O9FS);
 	free(fs, M_O9FS);
 	fs = mp->mnt_data = (qaddr_t)0;
 
@@ -255,6 +610,13 @@ o9fs_unmount(struct mount *mp, int mntflags, struct proc *p)
 	return 0;
 }
 
+int
+o9fs_init(struct vfsconf *vfc)
+{
+	pool_init(&o9fs_fidpool, sizeof(struct o9fid), 0, 0, 0, "o9fsfid", NULL);
+	return 0;
+}
+
 int
 o9fs_start(struct mount *mp, int flags, struct proc *p)
 {
@@ -265,7 +627,7 @@ int
 o9fs_statfs(struct mount *mp, struct statfs *sbp, struct proc *p)
 {
 	sbp->f_bsize = DEV_BSIZE;
-	sbp->f_iosize = VFSTOO9FS(mp)->msize;
+	sbp->f_iosize = VFSTOO9FS(mp)->sess->msize - Maxhd;
 	sbp->f_blocks = 2;              /* 1K to keep df happy */
 	sbp->f_bfree = 0;
 	sbp->f_bavail = 0;
@@ -281,6 +643,58 @@ o9fs_statfs(struct mount *mp, struct statfs *sbp, struct proc *p)
 	return 0;
 }
 
+static int
+isfs(struct mount *mp)
+{
+	return strcmp(mp->mnt_stat.f_fstypename, MOUNT_O9FS) == 0 && mp->mnt_data != NULL;
+}
+
+int
+o9fs_sysctl(int *name, u_int namelen, void *oldp, size_t *oldlenp, void *newp, size_t newlen, struct proc *p)
+{
+	struct mount *mp;
+	struct o9fsstats *st;
+	size_t n, len;
+	int error;
+
+	if (namelen != 1)
+		return ENOTDIR;
+
+	switch (name[0]) {
+	case O9FS_STATS:
+		if (newp != NULL)
+			return EPERM;
+
+		/* Take a snapshot first, copyout may sleep */
+		n = 0;
+		CIRCLEQ_FOREACH(mp, &mountlist, mnt_list)
+			if (isfs(mp))
+				n++;
+		len = n * sizeof(struct o9fsstats);
+		if (oldp == NULL) {
+			*oldlenp = len;
+			return 0;
+		}
+		if (*oldlenp < len)
+			return ENOMEM;
+		if (n == 0) {
+			*oldlenp = 0;
+			return 0;
+		}
+
+		st = malloc(len, M_TEMP, M_WAITOK | M_ZERO);
+		n = 0;
+		CIRCLEQ_FOREACH(mp, &mountlist, mnt_list)
+			if (isfs(mp) && n * sizeof(*st) < len)
+				o9fs_getstats(VFSTOO9FS(mp), &st[n++]);
+		error = copyout(st, oldp, len);
+		free(st, M_TEMP);
+		*oldlenp = len;
+		return error;
+	default:
+		return EOPNOTSUPP;
+	}
+}
 
 #define o9fs_sync ((int (*)(struct mount *, int, struct ucred *, \
                                   struct proc *))nullop)
@@ -288,10 +702,6 @@ o9fs_statfs(struct mount *mp, struct statfs *sbp, struct proc *p)
             struct vnode **))eopnotsupp)
 #define o9fs_quotactl ((int (*)(struct mount *, int, uid_t, caddr_t, \
             struct proc *))eopnotsupp)
-#define o9fs_sysctl ((int (*)(int *, u_int, void *, size_t *, void *, \
-            size_t, struct proc *))eopnotsupp)
-#define o9fs_vget ((int (*)(struct mount *, ino_t, struct vnode **)) \
-            eopnotsupp)
 #define o9fs_vptofh ((int (*)(struct vnode *, struct fid *))eopnotsupp)
 #define o9fs_checkexp ((int (*)(struct mount *, struct mbuf *,        \
         int *, struct ucred **))eopnotsupp)
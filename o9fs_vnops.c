@@ -14,6 +14,7 @@
 #include <sys/mount.h>
 #include <sys/malloc.h>
 #include <sys/namei.h>
+#include <sys/hash.h>
 #include <sys/syscallargs.h>
 
 #include "o9fs.h"
@@ -37,13 +38,16 @@ int o9fs_readdir(void *);
 int o9fs_remove(void *);
 int o9fs_inactive(void *);
 int o9fs_reclaim(void *);
+int o9fs_lock(void *);
+int o9fs_unlock(void *);
+int o9fs_islocked(void *);
 
 int (**o9fs_vnodeop_p)(void *);
 
 struct vops o9fs_vops = {
-	.vop_lock = vop_generic_lock,
-	.vop_unlock = vop_generic_unlock,
-	.vop_islocked = vop_generic_islocked,
+	.vop_lock = o9fs_lock,
+	.vop_unlock = o9fs_unlock,
+	.vop_islocked = o9fs_islocked,
 	.vop_abortop = vop_generic_abortop,
 	.vop_access = o9fs_access,
 	.vop_advlock = eopnotsupp,
@@ -80,42 +84,144 @@ struct vops o9fs_vops = {
 };
 	
 	
+/* 9P access mode of the file flags of an open */
+static int
+accmode(int fflags)
+{
+	switch (fflags & (FREAD | FWRITE)) {
+	case FWRITE:
+		return O9FS_OWRITE;
+	case FREAD | FWRITE:
+		return O9FS_ORDWR;
+	default:
+		return O9FS_OREAD;
+	}
+}
+
+static int accflags[] = { FREAD, FWRITE, FREAD | FWRITE };
+
+/*
+ * The open fid of vp to read from, or write to if rw is FWRITE, in *fp.
+ * An ORDWR one will do for both, one that is open already is
+ * preferred, otherwise it is opened now. Returns the error of the
+ * open, or EBADF if vp is not open.
+ */
+static int
+o9fs_iofid(struct o9fs *fs, struct vnode *vp, int rw, struct o9fid **fp)
+{
+	struct o9node *np;
+	struct o9fid *f;
+	int m[2], i, error;
+
+	np = VTON(vp);
+	*fp = NULL;
+	m[0] = rw == FWRITE ? O9FS_OWRITE : O9FS_OREAD;
+	m[1] = O9FS_ORDWR;
+	for (i = 0; i < 2; i++)
+		if ((f = np->open[m[i]]) != NULL && f->mode != -1) {
+			*fp = f;
+			return 0;
+		}
+	for (i = 0; i < 2; i++)
+		if ((f = np->open[m[i]]) != NULL) {
+			if ((error = o9fs_walkopen(fs, np->fid, f, accflags[m[i]])) < 0)
+				return error < -1 ? -error : EIO;
+			o9fs_attrcheck(np, &f->qid);
+			*fp = f;
+			return 0;
+		}
+	return EBADF;
+}
+
+/*
+ * An open fid of vp, or its own if it has none.
+ */
+static struct o9fid *
+o9fs_openfid(struct vnode *vp)
+{
+	struct o9node *np;
+	int m;
+
+	np = VTON(vp);
+	if (np->created != NULL)
+		return np->created;
+	for (m = O9FS_OREAD; m <= O9FS_ORDWR; m++)
+		if (np->open[m] != NULL && np->open[m]->mode != -1)
+			return np->open[m];
+	return np->fid;
+}
+
+/*
+ * Drop an open of vp with access mode m, the last one clunks its fid.
+ */
+static void
+o9fs_openrele(struct o9fs *fs, struct vnode *vp, int m)
+{
+	struct o9node *np;
+	struct o9fid *f;
+
+	np = VTON(vp);
+	if ((f = np->open[m]) == NULL || --f->ref > 0)
+		return;
+	np->open[m] = NULL;
+	o9fs_clunkdefer(fs, f);
+}
+
+/*
+ * The opens of vp with the same access mode share one fid, counted
+ * in its ref. Most files are opened to be stat'ed and closed, so its
+ * Topen waits for the first read or write, see o9fs_iofid.
+ * A truncate cannot wait, it gets a Topen of its own if need be.
+ * The open after a create takes the fid the create opened.
+ */
 int 
 o9fs_open(void *v)
 {
 	struct vop_open_args *ap;
 	struct vnode *vp;
-	struct proc *p;
 	struct o9fs *fs;
-	struct o9fid *f, *nf;
+	struct o9node *np;
+	struct o9fid *f, *tf;
+	int m, error;
 	DIN();
 
 	ap = v;
 	vp = ap->a_vp;
-	p = ap->a_p;
 	fs = VFSTOO9FS(vp->v_mount);
-	f = VTO9(vp);
+	np = VTON(vp);
+	m = accmode(ap->a_mode);
 
 	printvp(vp);
 
-	/* BUG: old fid leakage */
-	nf = o9fs_walk(fs, f, NULL, NULL);
-	if (nf == NULL) {
-		DRET();
-		return -1;
+	if ((f = np->open[m]) != NULL)
+		f->ref++;
+	else if (np->created != NULL) {
+		f = np->open[m] = np->created;
+		np->created = NULL;
+		f->ref = 1;
+	} else {
+		f = np->open[m] = o9fs_clonefid(fs, np->fid);
+		f->ref = 1;
 	}
 
-	if (o9fs_opencreate(fs, nf, O9FS_TOPEN, ap->a_mode, 0, 0) < 0) {
-		DBG("failed open\n");
-		o9fs_putfid(fs, nf);
+	error = 0;
+	if (ap->a_mode & O_TRUNC) {
+		np->flags &= ~O9NODE_ATTR;
+		if (f->mode == -1)
+			error = o9fs_walkopen(fs, np->fid, f, ap->a_mode);
+		else {
+			tf = o9fs_clonefid(fs, np->fid);
+			error = o9fs_walkopen(fs, np->fid, tf, ap->a_mode);
+			if (error == 0)
+				o9fs_clunkremove(fs, tf, O9FS_TCLUNK);
+			o9fs_putfid(fs, tf);
+		}
+	}
+	if (error) {
+		o9fs_openrele(fs, vp, m);
 		DRET();
-		return -1;
+		return error < -1 ? -error : EIO;
 	}
-
-	nf->parent = f;
-	vp->v_data = nf; /* walk has set other properties */
-
-out:
 	DRET();
 	return 0;
 }
@@ -125,14 +231,13 @@ o9fs_close(void *v)
 {
 	struct vop_close_args *ap;
 	struct vnode *vp;
-	struct o9fid *f;
-	struct o9fs *fs;
 	DIN();
 
 	ap = v;
 	vp = ap->a_vp;
 
 	printvp(vp);
+	o9fs_openrele(VFSTOO9FS(vp->v_mount), vp, accmode(ap->a_fflag));
 	DRET();
 	return 0;
 }
@@ -163,7 +268,7 @@ o9fs_create(void *v)
 	struct vnode *dvp, **vpp;
 	struct componentname *cnp;
 	struct vattr *vap;
-	struct o9fid *f, *nf;
+	struct o9fid *f, *cf, *nf;
 	struct o9fs *fs;
 	int error;
 	DIN();
@@ -183,30 +288,32 @@ o9fs_create(void *v)
 		return -1;
 	}
 
-	/* BUG: old fid leakage */
-	nf = o9fs_walk(fs, f, NULL, NULL);
-	if (nf == NULL) {
-		o9fs_putfid(fs, nf);
-		DRET();
-		return -1;
-	}
-
-	if (o9fs_opencreate(fs, nf, O9FS_TCREATE, 0, vap->va_mode, cnp->cn_nameptr) < 0) {
-		o9fs_putfid(fs, nf);
+	/*
+	 * The fid of the create is kept for the open that follows,
+	 * the vnode's own is only walked to if something needs it.
+	 */
+	cf = o9fs_walkcreate(fs, f, cnp->cn_nameptr, vap->va_mode,
+	    vap->va_mode & S_IFDIR ? FREAD : FREAD | FWRITE);
+	if (cf == NULL) {
 		DRET();
 		return -1;
 	}
-	o9fs_clunkremove(fs, nf, O9FS_TCLUNK);
-
-	/* walk from parent dir to get an unopened fid, break create+open atomicity of 9P */
-	nf = o9fs_walk(fs, f, NULL, cnp->cn_nameptr);
-	if (nf == NULL) {
-		o9fs_putfid(fs, nf);
+	if ((nf = o9fs_lazyfid(fs, cf)) == NULL &&
+	    (nf = o9fs_walk(fs, f, NULL, cnp->cn_nameptr)) == NULL) {
+		o9fs_clunkremove(fs, cf, O9FS_TCLUNK);
+		o9fs_putfid(fs, cf);
 		DRET();
 		return -1;
 	}
 	
-	error = o9fs_allocvp(dvp->v_mount, nf, vpp, 0);
+	o9fs_dirpurge(fs, VTON(dvp));
+	error = o9fs_nodeget(fs, nf, vpp, 0);
+	if (error == 0 && (cnp->cn_flags & MAKEENTRY))
+		cache_enter(dvp, *vpp, cnp);
+	if (error == 0 && VTON(*vpp)->created == NULL)
+		VTON(*vpp)->created = cf;
+	else
+		o9fs_clunkdefer(fs, cf);
 	vput(dvp);
 	DRET();
 	return error;
@@ -240,12 +347,12 @@ o9fs_read(void *v)
 	struct uio *uio;
 	struct o9fid *f;
 	struct o9fs *fs;
-	uint32_t n;
+	long n;
+	int error;
 
 	ap = v;
 	vp = ap->a_vp;
 	uio = ap->a_uio;
-	f = VTO9(vp);
 	fs = VFSTOO9FS(vp->v_mount);
 
 	if (uio->uio_offset < 0)
@@ -254,10 +361,15 @@ o9fs_read(void *v)
 	if (uio->uio_resid == 0)
 		return 0;
 
-	n = o9fs_rdwr(fs, f, O9FS_TREAD, o9fs_sanelen(fs, uio->uio_resid), uio->uio_offset);
-	if (n > 0)
-		return uiomove(fs->inbuf + Minhd + 4, n, uio);
-	return n;
+	if ((error = o9fs_iofid(fs, vp, FREAD, &f)) != 0)
+		return error;
+
+	n = o9fs_rdwr(fs, f, O9FS_TREAD, uio, o9fs_sanelen(fs, uio->uio_resid), uio->uio_offset);
+	if (n < -1)
+		return -n;
+	if (n < 0)
+		return EIO;
+	return 0;
 }
 
 static long
@@ -307,6 +419,30 @@ dirpackage(u_char *buf, long ts, struct o9stat **d)
 	return nn;
 }
 
+/*
+ * Read up to len bytes of the entries of the directory f into buf.
+ */
+static long
+dirread(struct o9fs *fs, struct o9fid *f, u_char *buf, long len)
+{
+	struct uio auio;
+	struct iovec aiov;
+	long n;
+
+	aiov.iov_base = buf;
+	aiov.iov_len = auio.uio_resid = len;
+	auio.uio_iov = &aiov;
+	auio.uio_iovcnt = 1;
+	auio.uio_offset = f->offset;
+	auio.uio_segflg = UIO_SYSSPACE;
+	auio.uio_rw = UIO_READ;
+	auio.uio_procp = curproc;
+	n = o9fs_rdwr(fs, f, O9FS_TREAD, &auio, len, f->offset);
+	if (n > 0)
+		f->offset += n;
+	return n;
+}
+
 int
 o9fs_readdir(void *v)
 {	
@@ -317,17 +453,17 @@ o9fs_readdir(void *v)
 	struct o9fs *fs;
 	struct o9stat *stat;
 	struct dirent d;
-	u_char *buf, *nbuf;
-	uint32_t n, ts;
-	int error, i;
-	int64_t len;
+	u_char *buf;
+	long n, ts;
+	int error, i, full;
+	int64_t len, resid;
+	size_t size;
 	DIN();
 
 	ap = v;
 	vp = ap->a_vp;
 	uio = ap->a_uio;
 	fs = VFSTOO9FS(vp->v_mount);
-	f = VTO9(vp);
 	error = 0;
 
 	if (vp->v_type != VDIR) {
@@ -338,24 +474,52 @@ o9fs_readdir(void *v)
 		DRET();
 		return 0;
 	}
+	if ((error = o9fs_iofid(fs, vp, FREAD, &f)) != 0) {
+		DRET();
+		return error;
+	}
 
-	len = uio->uio_resid;
 	ts = n = 0;
-	buf = malloc(O9FS_DIRMAX, M_O9FS, M_WAITOK);
+	size = O9FS_DIRMAX;
+	buf = malloc(size, M_O9FS, M_WAITOK);
 
+	/*
+	 * The opens of vp share f. Each keeps its place in uio, as an
+	 * offset of f; one that finds f moved by another reads from
+	 * the start again up to its place.
+	 */
+	if (uio->uio_offset != f->offset) {
+		f->offset = 0;
+		while (f->offset < uio->uio_offset) {
+			len = o9fs_sanelen(fs, MIN(uio->uio_offset - f->offset, O9FS_DIRMAX));
+			if ((n = dirread(fs, f, buf, len)) <= 0)
+				break;
+		}
+		if (n < 0) {
+			free(buf, M_O9FS);
+			DRET();
+			return n < -1 ? -n : EIO;
+		}
+	}
+	full = f->offset == 0;
+
+	resid = uio->uio_resid;
 	for (;;) {
-		len = o9fs_sanelen(fs, len);
-		nbuf = o9fsrealloc(buf, ts+O9FS_DIRMAX-n, ts+O9FS_DIRMAX);
-		buf = nbuf;
-		n = o9fs_rdwr(fs, f, O9FS_TREAD, len, f->offset);
-		if (n <= 0)
+		/* No more than buf has room for, msize may be larger */
+		len = o9fs_sanelen(fs, MIN(resid, O9FS_DIRMAX));
+		if (ts + len > size) {
+			buf = o9fsrealloc(buf, size, ts + O9FS_DIRMAX);
+			size = ts + O9FS_DIRMAX;
+		}
+		if ((n = dirread(fs, f, buf + ts, len)) <= 0)
 			break;
-		memcpy(buf + ts, fs->inbuf + Minhd + 4, n);
-		f->offset += n;
 		ts += n;
-		len -= n;
+		resid -= n;
 	}
 
+	/* Read from the start to the end, not until the buffer was full */
+	full = full && n == 0 && len > 0;
+
 	if (ts >= 0) {
 		ts = dirpackage(buf, ts, &stat);
 		if (ts < 0)
@@ -367,6 +531,8 @@ o9fs_readdir(void *v)
 		DRET();
 		return -1;
 	}
+	if (full && ts >= 0 && fs->dircache > 0 && fs->actimeo > 0)
+		o9fs_dirsave(fs, VTON(vp), stat, ts);
 
 	for (i = 0; i < ts; i++) {
 		d.d_fileno = (uint32_t)stat[i].qid.path;
@@ -378,25 +544,38 @@ o9fs_readdir(void *v)
 		error = uiomove(&d, d.d_reclen, uio);
 		if (error) {
 			DBG("uiomove error\n");
-			DRET();
-			return -1;
+			break;
 		}
 	}
+
+	/* The dirents are smaller than the entries they come from */
+	uio->uio_offset = f->offset;
+	if (stat != NULL)
+		free(stat, M_O9FS);
 	DRET();
-	return 0;
+	return error ? -1 : 0;
 }
 
 int
 o9fs_remove(void *v)
 {
 	struct vop_remove_args *ap;
-	struct vnode *vp;
+	struct vnode *vp, *dvp;
 	DIN();
 
 	ap = v;
 	vp = ap->a_vp;
+	dvp = ap->a_dvp;
 
 	o9fs_clunkremove(VFSTOO9FS(vp->v_mount), VTO9(vp), O9FS_TREMOVE);
+	o9fs_nodeunhash(VTON(vp));
+	cache_purge(vp);
+	o9fs_dirpurge(VFSTOO9FS(vp->v_mount), VTON(dvp));
+	if (dvp == vp)
+		vrele(vp);
+	else
+		vput(vp);
+	vput(dvp);
 	DRET();
 	return 0;
 }
@@ -410,7 +589,7 @@ o9fs_write(void *v)
 	struct o9fid *f;
 	struct o9fs *fs;
 	int ioflag, error;
-	uint32_t n;
+	long n;
 	off_t offset;
 	DIN();
 
@@ -418,7 +597,6 @@ o9fs_write(void *v)
 	vp = ap->a_vp;
 	uio = ap->a_uio;
 	ioflag = ap->a_ioflag;
-	f = VTO9(vp);
 	fs = VFSTOO9FS(vp->v_mount);
 	error = n = 0;
 
@@ -432,31 +610,146 @@ o9fs_write(void *v)
 		return 0;
 	}
 
+	if ((error = o9fs_iofid(fs, vp, FWRITE, &f)) != 0) {
+		DRET();
+		return error;
+	}
+
 	offset = uio->uio_offset;
 	if (ioflag & IO_APPEND) {
 		struct stat st;
+		/* Others may have appended since the size was cached */
+		VTON(vp)->flags &= ~O9NODE_ATTR;
 		if(vn_stat(vp, &st, curproc) == 0)
 			offset = st.st_size;
 	}
 
-	n = o9fs_sanelen(fs, uio->uio_resid);
-	error = uiomove(fs->outbuf + Minhd + 4 + 8 + 4, n, uio);
-	if (error) {
-		DRET();
-		return -1;
-	}
-
-	n = o9fs_rdwr(fs, f, O9FS_TWRITE, n, offset);
+	n = o9fs_rdwr(fs, f, O9FS_TWRITE, uio, o9fs_sanelen(fs, uio->uio_resid), offset);
 	if (n < 0) {
 		DRET();
-		return -1;
+		return n < -1 ? -n : -1;
 	}
 
 	f->offset = offset + n;
+	VTON(vp)->flags &= ~O9NODE_ATTR;
 	DRET();
 	return 0;
 }
 
+/*
+ * The name looked up in cnp and those after it in the pathname, up to a
+ * dot or dot-dot, which are for lookup to see, joined by single slashes.
+ * Nil if there is only the one name.
+ */
+static char *
+walkahead(struct componentname *cnp)
+{
+	char *path, *p, *s, *e;
+	int nwname;
+
+	path = malloc(strlen(cnp->cn_nameptr) + 1, M_O9FS, M_WAITOK);
+	p = path;
+	nwname = 0;
+	for (s = cnp->cn_nameptr; *s != '\0' && nwname < O9FS_MAXWELEM; s = e) {
+		while (*s == '/')
+			s++;
+		for (e = s; *e != '\0' && *e != '/'; e++)
+			;
+		if (e == s || (e - s == 1 && s[0] == '.') ||
+		    (e - s == 2 && s[0] == '.' && s[1] == '.'))
+			break;
+		if (nwname++ > 0)
+			*p++ = '/';
+		memcpy(p, s, e - s);
+		p += e - s;
+	}
+	*p = '\0';
+	if (nwname < 2) {
+		free(path, M_O9FS);
+		return NULL;
+	}
+	return path;
+}
+
+/*
+ * A fid for the first n bytes of path from parf, walked to later if needed.
+ * Nil if the path is too long to be walked to, like o9fs_lazyfid.
+ */
+static struct o9fid *
+aheadfid(struct o9fs *fs, struct o9fid *parf, char *path, long n, struct o9qid *qid)
+{
+	struct o9fid *f;
+	char *p, save;
+
+	save = path[n];
+	path[n] = '\0';
+	p = o9fs_joinpath(parf->path, path);
+	path[n] = save;
+	if (p == NULL)
+		return NULL;
+	f = o9fs_getfid(fs);
+	f->conn = parf->conn;
+	f->path = p;
+	f->qid = *qid;
+	o9fs_fidlazy(fs, f);
+	return f;
+}
+
+/*
+ * Enter in the name cache the names of path after the first, which is
+ * vp, walked from parf in the same Twalk. Their qids are in qid, n in all,
+ * and lf is the fid of the last if it was walked to. A qid seen before
+ * stops it, its vnode might be locked here already.
+ */
+static void
+walkseed(struct o9fs *fs, struct o9fid *parf, struct vnode *vp, struct componentname *cnp,
+    char *path, struct o9qid *qid, int n, struct o9fid *lf)
+{
+	struct componentname cn;
+	struct vnode *dvp, *nvp;
+	struct o9fid *f;
+	char *s;
+	long len;
+	int i, j;
+
+	cn = *cnp;
+	dvp = vp;
+	s = path;
+	len = strchr(s, '/') - s;
+	for (i = 1; i < n; i++) {
+		s += len + 1;
+		for (len = 0; s[len] != '\0' && s[len] != '/'; len++)
+			;
+		if (qid[i].path == parf->qid.path)
+			break;
+		for (j = 0; j < i; j++)
+			if (qid[i].path == qid[j].path)
+				break;
+		if (j < i)
+			break;
+
+		if (i == n - 1 && lf != NULL) {
+			f = lf;
+			lf = NULL;
+		} else if ((f = aheadfid(fs, parf, path, s + len - path, &qid[i])) == NULL)
+			break;
+		if (o9fs_nodeget(fs, f, &nvp, 0) != 0)
+			break;
+		cn.cn_nameptr = s;
+		cn.cn_namelen = len;
+		cn.cn_hash = hash32_buf(s, len, HASHINIT);
+		cache_enter(dvp, nvp, &cn);
+		fs->stats.nameahead++;
+		if (dvp != vp)
+			vput(dvp);
+		dvp = nvp;
+	}
+	if (dvp != vp)
+		vput(dvp);
+	if (lf != NULL)
+		o9fs_clunkdefer(fs, lf);
+}
+
 int
 o9fs_lookup(void *v)
 {
@@ -465,8 +758,11 @@ o9fs_lookup(void *v)
 	struct vnode **vpp, *dvp;
 	struct proc *p;
 	struct o9fs *fs;
-	struct o9fid *f, *parf, *nf;
-	int flags, op, islast, error;
+	struct o9fid *f, *parf, *nf, *lf;
+	struct o9qid qid[O9FS_MAXWELEM];
+	struct vattr va;
+	uint32_t vers;
+	int flags, op, islast, error, nwname, nwalked;
 	long n;
 	char *path;
 	
@@ -485,28 +781,90 @@ o9fs_lookup(void *v)
 	error = 0;
 	*vpp = NULL;
 	path = NULL;
+	lf = NULL;
+	nwalked = 0;
 
-	if (parf->mode != -1) {
-		DBG("parent %d is open, moving to %d\n", parf->fid, parf->parent->fid);
+	if (cnp->cn_namelen == 1 && cnp->cn_nameptr[0] == '.') {
 		vref(dvp);
-		f = parf;
-		parf = parf->parent;
+		*vpp = dvp;
+		DRET();
+		return 0;
 	}
 
-	/* On dot, clone */
-	if (cnp->cn_namelen == 1 && cnp->cn_nameptr[0] == '.')
-		nf = NULL;
-	else {
-		path = malloc(cnp->cn_namelen, M_O9FS, M_WAITOK);
-		strlcpy(path, cnp->cn_nameptr, cnp->cn_namelen+1);
-		nf = o9fs_getfid(fs);
+	/*
+	 * The name cache locks the vnode it finds like below. As in nfs,
+	 * a hit holds only while the directory's getattr, good for actimeo,
+	 * finds its qid.vers unchanged; attrcheck purges its names otherwise.
+	 */
+	vers = parf->qid.vers;
+	if ((error = cache_lookup(dvp, vpp, cnp)) >= 0) {
+		if (error != 0 && error != ENOENT) {
+			DRET();
+			return error;
+		}
+		VOP_GETATTR(dvp, &va, cnp->cn_cred, p);
+		if (parf->qid.vers == vers) {
+			fs->stats.namehit++;
+			DRET();
+			return error;
+		}
+		if (error == 0) {
+			if (*vpp == dvp)
+				vrele(*vpp);
+			else
+				vput(*vpp);
+			*vpp = NULL;
+		}
+		if (cnp->cn_flags & PDIRUNLOCK) {
+			if ((error = vn_lock(dvp, LK_EXCLUSIVE, p)) != 0) {
+				DRET();
+				return error;
+			}
+			cnp->cn_flags &= ~PDIRUNLOCK;
+		}
+		error = 0;
 	}
-	printvp(dvp);
+	fs->stats.namemiss++;
+
+	/* A name missing from a listing needs no walk to fail */
+	if ((flags & ISDOTDOT) == 0 &&
+	    o9fs_dirabsent(fs, VTON(dvp), cnp->cn_nameptr, cnp->cn_namelen))
+		f = NULL;
+	else if (!islast && (flags & (ISDOTDOT | MAKEENTRY)) == MAKEENTRY &&
+	    parf->path != NULL && (path = walkahead(cnp)) != NULL) {
+		/* The names after this one go in the same Twalk, see walkseed */
+		lf = o9fs_getfid(fs);
+		nwalked = o9fs_walkpath(fs, parf, lf, path, qid, &nwname);
+		if (nwalked < nwname)
+			lf = NULL;
+		f = NULL;
+		if (nwalked == 1 && lf != NULL) {
+			f = lf;
+			lf = NULL;
+		} else if (nwalked > 0 &&
+		    (f = aheadfid(fs, parf, path, cnp->cn_namelen, &qid[0])) == NULL) {
+			/* Too long a path to walk to later, this name is walked now */
+			if (lf != NULL)
+				o9fs_clunkdefer(fs, lf);
+			lf = NULL;
+			nwalked = 0;
+			path[cnp->cn_namelen] = '\0';
+			f = o9fs_walk(fs, parf, o9fs_getfid(fs), path);
+		}
+	} else {
+		path = malloc(cnp->cn_namelen + 1, M_O9FS, M_WAITOK);
+		strlcpy(path, cnp->cn_nameptr, cnp->cn_namelen + 1);
+		nf = o9fs_getfid(fs);
+		printvp(dvp);
 
-	/* BUG: fid and path leakage */
-	f = o9fs_walk(fs, parf, nf, path);
+		f = o9fs_walk(fs, parf, nf, path);
+		free(path, M_O9FS);
+		path = NULL;
+	}
 	if (f == NULL) {
 		DBG("%s not found\n", cnp->cn_nameptr);
+		if (path != NULL)
+			free(path, M_O9FS);
 		if (islast && (op == CREATE || op == RENAME)) {
 			/* save the name. it's gonna be used soon */
 			cnp->cn_flags |= SAVENAME;
@@ -518,24 +876,49 @@ o9fs_lookup(void *v)
 		return ENOENT;
 	}
 	
-	error = o9fs_allocvp(fs->mp, f, vpp, 0);
+	/*
+	 * The vnode may be in the hash and locked by somebody looking up
+	 * its way down to dvp, so dvp is unlocked first on dot-dot.
+	 */
+	if (f->qid.path == parf->qid.path) {
+		/* E.g. dot-dot at the root of the tree */
+		o9fs_clunkdefer(fs, f);
+		vref(dvp);
+		*vpp = dvp;
+	} else if (flags & ISDOTDOT) {
+		VOP_UNLOCK(dvp, 0, p);
+		cnp->cn_flags |= PDIRUNLOCK;
+		error = o9fs_nodeget(fs, f, vpp, 0);
+		if (error) {
+			if (vn_lock(dvp, LK_EXCLUSIVE | LK_RETRY, p) == 0)
+				cnp->cn_flags &= ~PDIRUNLOCK;
+		} else if (islast && (flags & LOCKPARENT)) {
+			if ((error = vn_lock(dvp, LK_EXCLUSIVE, p)) != 0) {
+				vput(*vpp);
+				*vpp = NULL;
+			} else
+				cnp->cn_flags &= ~PDIRUNLOCK;
+		}
+	} else {
+		error = o9fs_nodeget(fs, f, vpp, 0);
+		if (error == 0 && islast && !(flags & LOCKPARENT)) {
+			VOP_UNLOCK(dvp, 0, p);
+			cnp->cn_flags |= PDIRUNLOCK;
+		}
+	}
+	if (error == 0 && nwalked > 1 && *vpp != dvp)
+		walkseed(fs, parf, *vpp, cnp, path, qid, nwalked, lf);
+	else if (lf != NULL)
+		o9fs_clunkdefer(fs, lf);
+	if (path != NULL)
+		free(path, M_O9FS);
 	if (error) {
-		*vpp = NULL;
-		DBG("could not alloc vnode\n");
+		DBG("could not get vnode\n");
 		DRET();
-		return ENOENT;
+		return error;
 	}
-	
-	/* fix locking on parent dir */
-	if (islast && !(cnp->cn_flags & LOCKPARENT)) {
-		VOP_UNLOCK(dvp, 0, p);
-		flags |= PDIRUNLOCK;
-	}
-
-	if(f->qid.type == O9FS_QTDIR)
-		(*vpp)->v_type = VDIR;
-	else
-		(*vpp)->v_type = VREG;
+	if (cnp->cn_flags & MAKEENTRY)
+		cache_enter(dvp, *vpp, cnp);
 	printvp(*vpp);
 
 	DRET();
@@ -548,6 +931,7 @@ o9fs_getattr(void *v)
 	struct vop_getattr_args *ap;
 	struct vnode *vp;
 	struct vattr *vap;
+	struct o9node *np;
 	struct o9fid *f;
 	struct o9stat *stat;
 	struct o9fs *fs;
@@ -556,6 +940,7 @@ o9fs_getattr(void *v)
 	ap = v;
 	vp = ap->a_vp;
 	vap = ap->a_vap;
+	np = VTON(vp);
 	f = VTO9(vp);
 	fs = VFSTOO9FS(vp->v_mount);
 
@@ -564,11 +949,23 @@ o9fs_getattr(void *v)
 		return 0;
 	}
 
-	stat = o9fs_stat(fs, f);
-	if (stat == NULL) {
-		DRET();
-		return 0;
-	}
+	/*
+	 * The stat is kept for actimeo ticks. A file just created is
+	 * stat'ed through its open fid, its own is lazy.
+	 */
+	stat = &np->attr;
+	if (!(np->flags & O9NODE_ATTR) || ticks - np->attrtime >= fs->actimeo) {
+		fs->stats.attrmiss++;
+		np->flags &= ~O9NODE_ATTR;
+		if (o9fs_stat(fs, (f->flags & O9FID_LAZY) ? o9fs_openfid(vp) : f, stat) < 0) {
+			DRET();
+			return 0;
+		}
+		o9fs_attrcheck(np, &stat->qid);
+		np->attrtime = ticks;
+		np->flags |= O9NODE_ATTR;
+	} else
+		fs->stats.attrhit++;
 	
 	bzero(vap, sizeof(*vap));
 	vattr_null(vap);
@@ -576,7 +973,7 @@ o9fs_getattr(void *v)
 	vap->va_gid = 0;
 	vap->va_fsid = vp->v_mount->mnt_stat.f_fsid.val[0];
 	vap->va_size = stat->length;
-	vap->va_blocksize = VFSTOO9FS(vp->v_mount)->msize - Maxhd;
+	vap->va_blocksize = VFSTOO9FS(vp->v_mount)->sess->msize - Maxhd;
 	vap->va_atime.tv_sec = stat->atime;
 	vap->va_mtime.tv_sec = stat->mtime;
 	vap->va_ctime.tv_sec = stat->atime;
@@ -588,9 +985,7 @@ o9fs_getattr(void *v)
 	vap->va_mode = o9fs_permtou(stat->mode);
 	vap->va_nlink = 1;
 	vap->va_fileid = f->qid.path;	/* qid.path is 64bit, va_fileid 32bit */
-	vap->va_filerev = f->qid.vers;
-
-	free(stat, M_O9FS);
+	vap->va_filerev = stat->qid.vers;
 	DRET();
 	return 0;
 }
@@ -620,7 +1015,16 @@ o9fs_inactive(void *v)
 	ap = v;
 	vp = ap->a_vp;
 	f = VTO9(vp);
-	if(!(vp->v_flag & VXLOCK))
+
+	/* The open fid of a create no open took, e.g. of mkdir */
+	if (VTON(vp)->created != NULL) {
+		o9fs_clunkdefer(VFSTOO9FS(vp->v_mount), VTON(vp)->created);
+		VTON(vp)->created = NULL;
+	}
+	VOP_UNLOCK(vp, 0, ap->a_p);
+
+	/* Hashed vnodes stay on the free list for the next lookup */
+	if (!(VTON(vp)->flags & O9NODE_HASHED) && !(vp->v_flag & VXLOCK))
 		vgone(vp);
 	DRET();
 	return 0;
@@ -632,6 +1036,8 @@ o9fs_reclaim(void *v)
 	struct vop_reclaim_args *ap;
 	struct vnode *vp;
 	struct o9fid *f;
+	struct o9fs *fs;
+	int m;
 	DIN();
 	
 	ap = v;
@@ -639,10 +1045,54 @@ o9fs_reclaim(void *v)
 	f = VTO9(vp);
 	printvp(vp);
 
-	/* TODO: Removed fids should not be clunked again */
-	o9fs_clunkremove(VFSTOO9FS(vp->v_mount), f, O9FS_TCLUNK);
-//	o9fs_putfid(VFSTOO9FS(vp->v_mount), f);
+	/* The clunks go in the background, a removed fid needs none */
+	fs = VFSTOO9FS(vp->v_mount);
+	o9fs_nodeunhash(VTON(vp));
+	o9fs_dirpurge(fs, VTON(vp));
+	if (f != NULL)
+		o9fs_clunkdefer(fs, f);
+	if (VTON(vp)->created != NULL)
+		o9fs_clunkdefer(fs, VTON(vp)->created);
+
+	/* Opens that were never closed, e.g. on a forced unmount */
+	for (m = O9FS_OREAD; m <= O9FS_ORDWR; m++)
+		if (VTON(vp)->open[m] != NULL) {
+			VTON(vp)->open[m]->ref = 1;
+			o9fs_openrele(fs, vp, m);
+		}
+	free(vp->v_data, M_O9FS);
 	vp->v_data = NULL;
 	DRET();
 	return 0;
 }
+
+/*
+ * Vnode locks are real so that processes can use the mount at the
+ * same time. Shared requests, e.g. from lookups and reads, are honoured.
+ */
+int
+o9fs_lock(void *v)
+{
+	struct vop_lock_args *ap;
+
+	ap = v;
+	return lockmgr(&VTON(ap->a_vp)->lock, ap->a_flags, NULL);
+}
+
+int
+o9fs_unlock(void *v)
+{
+	struct vop_unlock_args *ap;
+
+	ap = v;
+	return lockmgr(&VTON(ap->a_vp)->lock, ap->a_flags | LK_RELEASE, NULL);
+}
+
+int
+o9fs_islocked(void *v)
+{
+	struct vop_islocked_args *ap;
+
+	ap = v;
+	return lockstatus(&VTON(ap->a_vp)->lock);
+}
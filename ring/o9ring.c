@@ -0,0 +1,200 @@
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "o9ring.h"
+
+#define membar()	__sync_synchronize()
+
+enum {
+	Spin = 2000,		/* Default polls before sleeping */
+};
+
+size_t
+o9ring_size(uint32_t nslot, uint32_t slotsize)
+{
+	return sizeof(struct o9ringhdr) + 2 * (size_t)nslot * slotsize;
+}
+
+/*
+ * Lay out an empty ring pair in mem, o9ring_size bytes long.
+ */
+int
+o9ring_init(void *mem, uint32_t nslot, uint32_t slotsize)
+{
+	struct o9ringhdr *h;
+
+	if (nslot == 0 || (nslot & (nslot - 1)) != 0 || slotsize < 7)
+		return -1;
+
+	h = mem;
+	memset(h, 0, sizeof(*h));
+	h->nslot = nslot;
+	h->slotsize = slotsize;
+	membar();
+	h->magic = O9RING_MAGIC;
+	return 0;
+}
+
+int
+o9ring_attach(struct o9ring *r, void *mem, int side, int sleep, int wake)
+{
+	struct o9ringhdr *h;
+
+	h = mem;
+	if (h->magic != O9RING_MAGIC)
+		return -1;
+	membar();
+
+	memset(r, 0, sizeof(*r));
+	r->hdr = h;
+	r->slots[O9RING_T] = (u_char *)mem + sizeof(*h);
+	r->slots[O9RING_R] = r->slots[O9RING_T] + (size_t)h->nslot * h->slotsize;
+	r->tx = side;
+	r->rx = !side;
+	r->head = h->idx[r->tx].head;
+	r->tail = h->idx[r->rx].tail;
+	r->sleep = sleep;
+	r->wake = wake;
+	r->spin = Spin;
+
+	/* A full bell means the other side has a wakeup pending anyway */
+	return fcntl(wake, F_SETFL, fcntl(wake, F_GETFL) | O_NONBLOCK);
+}
+
+/*
+ * Wake the other side if it went to sleep, flag is its waiting flag.
+ */
+static void
+bell(struct o9ring *r, volatile uint32_t *flag)
+{
+	membar();
+	if (*flag) {
+		r->nbell++;
+		write(r->wake, "", 1);
+	}
+}
+
+/*
+ * Wait for *p to move on from v, polling first, then sleeping
+ * with flag set so that the other side rings the bell.
+ */
+static int
+waitfor(struct o9ring *r, volatile uint32_t *p, uint32_t v, volatile uint32_t *flag)
+{
+	struct pollfd pfd;
+	char buf[64];
+	int i, n;
+
+	for (i = 0; i < r->spin; i++)
+		if (*p != v)
+			return 0;
+
+	for (;;) {
+		*flag = 1;
+		membar();
+		if (*p != v)
+			break;
+		r->nsleep++;
+		n = read(r->sleep, buf, sizeof(buf));
+		if (n < 0 && errno == EAGAIN) {
+			/* sleep is wake too, made non-blocking by o9ring_attach */
+			pfd.fd = r->sleep;
+			pfd.events = POLLIN;
+			poll(&pfd, 1, -1);
+			continue;
+		}
+		if (n <= 0 && errno != EINTR) {
+			*flag = 0;
+			return -1;
+		}
+	}
+	*flag = 0;
+	return 0;
+}
+
+/*
+ * A slot to put the next message in, visible to the other side
+ * after o9ring_flush. Waits for the other side to free one if
+ * the ring is full. A client keeps at most nslot requests
+ * outstanding, so the server never has to wait here.
+ */
+u_char *
+o9ring_post(struct o9ring *r)
+{
+	struct o9ringhdr *h;
+	struct o9ringidx *x;
+	uint32_t t;
+
+	h = r->hdr;
+	x = &h->idx[r->tx];
+	while (r->head - (t = x->tail) == h->nslot) {
+		o9ring_flush(r);
+		if (waitfor(r, &x->tail, t, &x->pwait) < 0)
+			return NULL;
+	}
+	return r->slots[r->tx] + (size_t)(r->head++ & (h->nslot - 1)) * h->slotsize;
+}
+
+/*
+ * Publish the messages posted so far.
+ */
+void
+o9ring_flush(struct o9ring *r)
+{
+	struct o9ringidx *x;
+
+	x = &r->hdr->idx[r->tx];
+	if (x->head == r->head)
+		return;
+	membar();
+	x->head = r->head;
+	bell(r, &x->cwait);
+}
+
+/*
+ * The next message from the other side, or nil if there is none
+ * and wait is not set. It stays valid until o9ring_release.
+ * Before sleeping, whatever was posted is flushed and whatever
+ * was taken is released, or both sides could wait for each other.
+ */
+u_char *
+o9ring_next(struct o9ring *r, int wait)
+{
+	struct o9ringhdr *h;
+	struct o9ringidx *x;
+
+	h = r->hdr;
+	x = &h->idx[r->rx];
+	while (r->tail == x->head) {
+		if (!wait)
+			return NULL;
+		o9ring_flush(r);
+		o9ring_release(r);
+		if (waitfor(r, &x->head, r->tail, &x->cwait) < 0)
+			return NULL;
+	}
+	membar();
+	return r->slots[r->rx] + (size_t)(r->tail++ & (h->nslot - 1)) * h->slotsize;
+}
+
+/*
+ * Hand the slots of the messages taken so far back to the other side.
+ */
+void
+o9ring_release(struct o9ring *r)
+{
+	struct o9ringidx *x;
+
+	x = &r->hdr->idx[r->rx];
+	if (x->tail == r->tail)
+		return;
+	membar();
+	x->tail = r->tail;
+	bell(r, &x->pwait);
+}
@@ -0,0 +1,72 @@
+/*
+ * A shared memory transport for 9P between a client and a server on
+ * the same host, in place of a socket.
+ *
+ * The shared region holds a header and two rings of nslot slots each,
+ * T-messages going from the client to the server and R-messages back.
+ * A slot holds one 9P message, size[4] first as usual, of at most
+ * slotsize bytes, so slotsize is the msize of the session.
+ *
+ * The producer of a ring fills slots from its head and publishes the
+ * new head once per batch; the consumer takes slots up to the head and
+ * publishes its tail once it is done with them. Neither side makes a
+ * system call while the other is busy: a side that runs out of work
+ * spins a while, then sets its waiting flag and sleeps on its bell,
+ * which the other side rings only if the flag is set.
+ */
+
+enum {
+	O9RING_MAGIC	= 0x474e5239,	/* "9RNG" */
+	O9RING_LINE		= 64,			/* Keeps the indices of each side apart */
+
+	O9RING_T		= 0,			/* Ring of T-messages, produced by the client */
+	O9RING_R		= 1,			/* Ring of R-messages, produced by the server */
+
+	O9RING_CLIENT	= O9RING_T,		/* Sides, by the ring they produce */
+	O9RING_SERVER	= O9RING_R,
+};
+
+struct o9ringidx {
+	volatile uint32_t	head;		/* Written by the producer */
+	volatile uint32_t	cwait;		/* The consumer sleeps until head moves */
+	char				pad0[O9RING_LINE - 8];
+	volatile uint32_t	tail;		/* Written by the consumer */
+	volatile uint32_t	pwait;		/* The producer sleeps until tail moves */
+	char				pad1[O9RING_LINE - 8];
+};
+
+struct o9ringhdr {
+	uint32_t	magic;
+	uint32_t	nslot;				/* Power of two */
+	uint32_t	slotsize;
+	char		pad[O9RING_LINE - 12];
+	struct		o9ringidx idx[2];	/* By ring */
+};
+
+/*
+ * One side's view of the region. The bells are file descriptors,
+ * e.g. the ends of two pipes: sleep is read to wait for the other
+ * side, wake is written to wake it up. Against the kernel, both are
+ * the server's end of the mount's unix socket, see o9fs_ringattach.
+ */
+struct o9ring {
+	struct	o9ringhdr *hdr;
+	u_char	*slots[2];
+	int		tx;					/* Ring this side produces */
+	int		rx;					/* Ring this side consumes */
+	uint32_t	head;			/* Slots posted on tx, published or not */
+	uint32_t	tail;			/* Slots taken from rx, released or not */
+	int		sleep;
+	int		wake;
+	int		spin;				/* Polls before going to sleep */
+	uint64_t	nbell;			/* Times the other side was woken */
+	uint64_t	nsleep;			/* Times this side slept */
+};
+
+size_t	o9ring_size(uint32_t, uint32_t);
+int		o9ring_init(void *, uint32_t, uint32_t);
+int		o9ring_attach(struct o9ring *, void *, int, int, int);
+u_char	*o9ring_post(struct o9ring *);
+void	o9ring_flush(struct o9ring *);
+u_char	*o9ring_next(struct o9ring *, int);
+void	o9ring_release(struct o9ring *);
@@ -0,0 +1,307 @@
+/*
+ * Compare the shared memory ring with a unix socket, the way o9fs
+ * talks to a server today: one write per T-message and two reads,
+ * header and body, per R-message. The server answers every Tread
+ * with count bytes; the client keeps batch requests in flight.
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "o9ring.h"
+
+#define GBIT8(p)	((p)[0])
+#define GBIT16(p)	((p)[0]|((p)[1]<<8))
+#define GBIT32(p)	((uint32_t)((p)[0]|((p)[1]<<8)|((p)[2]<<16)|((p)[3]<<24)))
+#define PBIT8(p,v)	(p)[0]=(v)
+#define PBIT16(p,v)	(p)[0]=(v);(p)[1]=(v)>>8
+#define PBIT32(p,v)	(p)[0]=(v);(p)[1]=(v)>>8;(p)[2]=(v)>>16;(p)[3]=(v)>>24
+
+enum {
+	Minhd	= 7,
+	Treadsz	= Minhd + 4 + 8 + 4,
+	Rreadhd	= Minhd + 4,
+
+	Tread	= 116,
+	Rread,
+	Tclunk	= 120,
+};
+
+static long nmsg = 200000;
+static int batch = 8;
+static uint32_t count = 4096;
+static uint32_t nslot = 64;
+static int spin = -1;
+
+static u_char *data;		/* What the server reads from */
+static u_char *buf;			/* What the client reads into */
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: ringbench [-b batch] [-c count] [-n messages] [-p spin] [-s slots]\n");
+	exit(1);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report(char *name, double t, uint64_t nbell, uint64_t nsleep)
+{
+	printf("%-6s batch %3d count %6u: %9.0f msgs/s %8.1f MB/s",
+	    name, batch, count, nmsg / t, nmsg * (double)count / t / (1024 * 1024));
+	if (nbell || nsleep)
+		printf(" (%llu bells, %llu sleeps)", (unsigned long long)nbell,
+		    (unsigned long long)nsleep);
+	printf("\n");
+}
+
+static u_char *
+tread(u_char *p, uint16_t tag)
+{
+	PBIT32(p, Treadsz);
+	PBIT8(p + 4, Tread);
+	PBIT16(p + 5, tag);
+	PBIT32(p + Minhd, 0);
+	memset(p + Minhd + 4, 0, 8);
+	PBIT32(p + Minhd + 4 + 8, count);
+	return p;
+}
+
+static u_char *
+tclunk(u_char *p)
+{
+	PBIT32(p, Minhd + 4);
+	PBIT8(p + 4, Tclunk);
+	PBIT16(p + 5, 0);
+	PBIT32(p + Minhd, 0);
+	return p;
+}
+
+/*
+ * Fill p with the Rread for the Tread in t.
+ */
+static long
+rread(u_char *p, u_char *t)
+{
+	uint32_t n;
+
+	n = GBIT32(t + Minhd + 4 + 8);
+	PBIT32(p, Rreadhd + n);
+	PBIT8(p + 4, Rread);
+	PBIT16(p + 5, GBIT16(t + 5));
+	PBIT32(p + Minhd, n);
+	memcpy(p + Rreadhd, data, n);
+	return Rreadhd + n;
+}
+
+static void
+readn(int fd, u_char *p, long n)
+{
+	long m;
+
+	for (; n > 0; p += m, n -= m)
+		if ((m = read(fd, p, n)) <= 0)
+			err(1, "read");
+}
+
+static void
+sockserve(int fd)
+{
+	u_char t[Treadsz], *r;
+
+	if ((r = malloc(Rreadhd + count)) == NULL)
+		err(1, NULL);
+	for (;;) {
+		readn(fd, t, Minhd);
+		readn(fd, t + Minhd, GBIT32(t) - Minhd);
+		if (GBIT8(t + 4) == Tclunk)
+			break;
+		if (write(fd, r, rread(r, t)) < 0)
+			err(1, "write");
+	}
+	free(r);
+}
+
+static double
+sockclient(int fd)
+{
+	u_char t[Treadsz], hd[Minhd];
+	long sent, recvd;
+	double t0;
+
+	t0 = now();
+	for (sent = recvd = 0; recvd < nmsg; ) {
+		for (; sent < nmsg && sent - recvd < batch; sent++)
+			if (write(fd, tread(t, sent % batch), Treadsz) != Treadsz)
+				err(1, "write");
+		readn(fd, hd, Minhd);
+		if (GBIT8(hd + 4) != Rread)
+			errx(1, "bad reply");
+		readn(fd, buf, GBIT32(hd) - Minhd);
+		recvd++;
+	}
+	t0 = now() - t0;
+	if (write(fd, tclunk(t), Minhd + 4) < 0)
+		err(1, "write");
+	return t0;
+}
+
+static void
+ringserve(struct o9ring *r)
+{
+	u_char *t;
+
+	while ((t = o9ring_next(r, 1)) != NULL) {
+		if (GBIT8(t + 4) == Tclunk)
+			break;
+		rread(o9ring_post(r), t);
+	}
+}
+
+static double
+ringclient(struct o9ring *r)
+{
+	u_char *p;
+	long sent, recvd;
+	double t0;
+
+	t0 = now();
+	for (sent = recvd = 0; recvd < nmsg; ) {
+		for (; sent < nmsg && sent - recvd < batch; sent++)
+			tread(o9ring_post(r), sent % batch);
+		o9ring_flush(r);
+		if ((p = o9ring_next(r, 1)) == NULL)
+			errx(1, "ring is gone");
+		if (GBIT8(p + 4) != Rread)
+			errx(1, "bad reply");
+		memcpy(buf, p + Rreadhd, GBIT32(p + Minhd));
+		recvd++;
+	}
+	o9ring_release(r);
+	t0 = now() - t0;
+	tclunk(o9ring_post(r));
+	o9ring_flush(r);
+	return t0;
+}
+
+static void
+benchsock(void)
+{
+	int fd[2], status;
+	double t;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0)
+		err(1, "socketpair");
+	switch (fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		close(fd[0]);
+		sockserve(fd[1]);
+		_exit(0);
+	}
+	close(fd[1]);
+	t = sockclient(fd[0]);
+	wait(&status);
+	close(fd[0]);
+	report("unix", t, 0, 0);
+}
+
+static void
+benchring(void)
+{
+	struct o9ring r;
+	void *mem;
+	size_t size;
+	uint32_t slotsize;
+	int cbell[2], sbell[2], status;
+	double t;
+
+	/* Slots are as large as the largest message, like msize */
+	slotsize = Rreadhd + count < Treadsz ? Treadsz : Rreadhd + count;
+	size = o9ring_size(nslot, slotsize);
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	if (mem == MAP_FAILED)
+		err(1, "mmap");
+	if (o9ring_init(mem, nslot, slotsize) < 0)
+		errx(1, "bad ring geometry");
+	if (pipe(cbell) < 0 || pipe(sbell) < 0)
+		err(1, "pipe");
+
+	switch (fork()) {
+	case -1:
+		err(1, "fork");
+	case 0:
+		if (o9ring_attach(&r, mem, O9RING_SERVER, sbell[0], cbell[1]) < 0)
+			err(1, "o9ring_attach");
+		if (spin >= 0)
+			r.spin = spin;
+		ringserve(&r);
+		_exit(0);
+	}
+	if (o9ring_attach(&r, mem, O9RING_CLIENT, cbell[0], sbell[1]) < 0)
+		err(1, "o9ring_attach");
+	if (spin >= 0)
+		r.spin = spin;
+	t = ringclient(&r);
+	wait(&status);
+	report("ring", t, r.nbell, r.nsleep);
+	munmap(mem, size);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int ch;
+
+	while ((ch = getopt(argc, argv, "b:c:n:p:s:")) != -1) {
+		switch (ch) {
+		case 'b':
+			batch = strtol(optarg, NULL, 10);
+			break;
+		case 'c':
+			count = strtol(optarg, NULL, 10);
+			break;
+		case 'n':
+			nmsg = strtol(optarg, NULL, 10);
+			break;
+		case 'p':
+			spin = strtol(optarg, NULL, 10);
+			break;
+		case 's':
+			nslot = strtol(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (batch < 1 || nmsg < 1 || count > 1024 * 1024)
+		usage();
+	if (batch > nslot)
+		errx(1, "batch is larger than the ring");
+
+	if ((data = malloc(count + 1)) == NULL || (buf = malloc(Rreadhd + count)) == NULL)
+		err(1, NULL);
+	memset(data, 'x', count);
+
+	benchsock();
+	benchring();
+	return 0;
+}